@@ -0,0 +1,44 @@
+// Synthetic project used to benchmark project generation.
+//
+//   BCPP_BENCH_TARGETS=10000 buildcpp -C bench build
+//
+// Describes BCPP_BENCH_TARGETS (default 1000) static libraries with a few
+// sources, include directories and compile flags each. None of the sources
+// exist, the project is only meant to be generated, not built.
+
+#define BUILDCPP_ENTRY
+#include <buildcpp/buildcpp.h>
+#include <stdlib.h>
+
+using namespace bcpp;
+
+Project Generate(Toolchain toolchain) {
+    toolchain.compiler.standard = Standard::CPP_17;
+    toolchain.compiler.buildType = BuildType::Release;
+
+    Project project(toolchain);
+    project.includeDirectories = {"include"};
+
+    const char* numTargetsEnv = getenv("BCPP_BENCH_TARGETS");
+    const int numTargets = numTargetsEnv ? atoi(numTargetsEnv) : 1000;
+    project.targets.reserve(numTargets);
+    for (int i = 0; i < numTargets; i++) {
+        Target lib(FormatString("lib%d", i), TargetType::StaticLibrary, {
+            FormatString("src/lib%d/lib%d.cpp", i, i),
+            FormatString("src/lib%d/detail/impl.cpp", i),
+            FormatString("src/lib%d/detail/util.cpp", i),
+            FormatString("src/lib%d/platform/posix.cpp", i),
+        });
+        lib.includeDirectories = {
+            FormatString("src/lib%d/include", i),
+            "third_party/abseil",
+            "third_party/boost",
+            "third_party/fmt/include",
+        };
+        lib.compileFlags = {"-Wall", "-Wextra", "-Wno-unused-parameter", "-DBCPP_BENCH=1"};
+        lib.isDefault = false;
+        project.targets.emplace_back(std::move(lib));
+    }
+
+    return project;
+}
@@ -0,0 +1,96 @@
+// Cold and warm benchmark for buildcpp cache-cxx, driven through Ninja.
+//
+//   c++ -std=c++17 -O2 -pthread -Iinclude bench/cache.cpp -o cache_bench
+//   ./cache_bench [path/to/buildcpp]
+//
+// Generates a project of kNumSources sources and builds it with ninja, first
+// uncached, then through an empty cache, then with the objects deleted (Ninja
+// has already deleted the depfiles, so these are direct hits through the
+// cache's manifests), in a fresh build directory, and after a comment was
+// added to every source (preprocessed hits).
+
+#include "../single_include/buildcpp.h"
+
+namespace {
+
+const int kNumSources = 40;
+
+void WriteSources(const char* comment) {
+    for (int i = 0; i < kNumSources; i++) {
+        String source = FormatString(
+            "#include <map>\n#include <string>\n#include <vector>\n"
+            "int Source%d(const std::vector<std::string>& v) {\n"
+            "    std::map<std::string, int> counts;\n"
+            "    for (const auto& s : v) counts[s]++;\n"
+            "    return int(counts.size()) + %d;\n"
+            "}\n%s", i, i, comment);
+        WriteFile(FormatString("src/src%d.cpp", i), source.CStr(), source.Len());
+    }
+}
+
+void WriteProject() {
+    MakeDir("src");
+    WriteSources("");
+    NinjaWriter w;
+    w.Append("#define BUILDCPP_ENTRY\n#include <buildcpp/buildcpp.h>\nusing namespace bcpp;\n"
+             "Project Generate(Toolchain toolchain) {\n"
+             "    toolchain.compiler.buildType = BuildType::Release;\n"
+             "    Project project(toolchain);\n"
+             "    Target lib(\"lib\", TargetType::StaticLibrary, {\n");
+    for (int i = 0; i < kNumSources; i++) {
+        w.Append(FormatString("        \"src/src%d.cpp\",\n", i));
+    }
+    w.Append("    });\n    project.targets = {lib};\n    return project;\n}\n");
+    WriteFile("build.cpp", w.buf, w.used);
+}
+
+void Generate(const String& buildcpp, bool cached) {
+    if (Run(FormatString("%s%s build > /dev/null", buildcpp.CStr(), cached ? " --cache" : "")) != 0) {
+        Fatal("Failed to generate build/build.ninja\n");
+    }
+}
+
+template <typename Fn>
+void Time(const char* name, Fn fn) {
+    double start = NowMs();
+    fn();
+    double ms = NowMs() - start;
+    printf("%-20s %8.0f ms %8.1f ms/source\n", name, ms, ms / kNumSources);
+}
+
+void Build() {
+    if (Run("ninja -C build > /dev/null") != 0) {
+        Fatal("Failed to build\n");
+    }
+}
+
+} // namespace
+
+int main(int argc, const char** argv) {
+    String buildcpp = argc > 1 ? RealPath(argv[1]) : String("buildcpp");
+    char dir[] = "/tmp/bcpp_cache_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        Fatal("Failed to make a temporary directory\n");
+    }
+    ChangeDir(dir);
+    setenv("BCPP_CACHE_DIR", FormatString("%s/cache", dir).CStr(), 1);
+    WriteProject();
+
+    printf("%d sources\n", kNumSources);
+    Generate(buildcpp, false);
+    Time("uncached", Build);
+    Run("rm -rf build");
+    Generate(buildcpp, true);
+    Time("cold cache", Build);
+    Run("rm -rf build/bcppout");
+    Time("warm, direct", Build);
+    Run("rm -rf build");
+    Generate(buildcpp, true);
+    Time("fresh build dir", Build);
+    WriteSources("// Changes the source but not what it preprocesses to\n");
+    Time("warm, preprocessed", Build);
+    printf("\n");
+    CacheCxx(1, std::vector<const char*>{"--stats", nullptr}.data());
+
+    Run(FormatString("rm -rf %s", dir));
+}
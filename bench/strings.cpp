@@ -0,0 +1,144 @@
+// Microbenchmarks for buildcpp's String and path functions.
+//
+//   c++ -std=c++17 -O2 -pthread -Iinclude bench/strings.cpp -o strings_bench
+//   ./strings_bench
+
+#include "../single_include/buildcpp.h"
+
+#include <thread>
+
+namespace {
+
+const int kTotalAllocs = 1 << 20;
+const int kNumPaths = 100000;
+const int kPathRepeats = 20;
+
+template <typename Fn>
+double AllocsPerSecond(int numThreads, Fn fn) {
+    const int allocsPerThread = kTotalAllocs / numThreads;
+    double start = NowMs();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < allocsPerThread; i++) {
+                fn(i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return allocsPerThread * numThreads / ((NowMs() - start) / 1000.0);
+}
+
+// A corpus shaped like a real source tree: 2 to 9 directories deep, some
+// under long third_party prefixes, with a mix of source and header suffixes
+std::vector<String> MakePathCorpus() {
+    const char* roots[] = {"src", "lib", "tools", "third_party/llvm-project/llvm/lib"};
+    const char* dirs[] = {"core", "detail", "platform", "io", "transforms",
+                          "analysis", "support", "codegen", "x86_64", "internal"};
+    const char* exts[] = {".cpp", ".cc", ".h", ".inl.h", ""};
+    std::vector<String> paths;
+    paths.reserve(kNumPaths);
+    uint32_t rng = 12345;
+    auto next = [&]() { rng = rng * 1664525 + 1013904223; return rng >> 8; };
+    for (int i = 0; i < kNumPaths; i++) {
+        String path = roots[next() % 4];
+        int depth = 1 + next() % 8;
+        for (int d = 0; d < depth; d++) {
+            path = FormatString("%s/%s%u", path.CStr(), dirs[next() % 10], next() % 100);
+        }
+        paths.push_back(FormatString("%s/file_%d%s", path.CStr(), i, exts[next() % 5]));
+    }
+    return paths;
+}
+
+// The byte at a time versions the path helpers replaced, for comparison
+size_t BytewiseDirNameLen(const String& path) {
+    size_t lastPathSep = 0;
+    for (size_t i = 0; i < path.Len(); i++) {
+        if (path[i] == '/') lastPathSep = i;
+    }
+    return lastPathSep;
+}
+
+size_t BytewiseExtPos(const String& path) {
+    size_t basePos = BytewiseDirNameLen(path);
+    if (basePos < path.Len() && path[basePos] == '/') ++basePos;
+    while (basePos < path.Len() && path[basePos] == '.') ++basePos;
+    for (size_t extPos = path.Len(); extPos > basePos; --extPos) {
+        if (path[extPos - 1] == '.') return extPos - 1;
+    }
+    return path.Len();
+}
+
+template <typename Fn>
+double NsPerPath(const std::vector<String>& paths, Fn fn) {
+    size_t sink = 0;
+    double start = NowMs();
+    for (int r = 0; r < kPathRepeats; r++) {
+        auto tempMem = BeginTempStringArena();
+        for (const auto& path : paths) {
+            sink += fn(tempMem.arena, path);
+        }
+    }
+    double ns = (NowMs() - start) * 1e6 / (double(kPathRepeats) * paths.size());
+    if (sink == 0) printf("\n"); // Keep the work from being optimized away
+    return ns;
+}
+
+} // namespace
+
+void BenchPaths() {
+    std::vector<String> paths = MakePathCorpus();
+    size_t totalLen = 0;
+    int mismatches = 0;
+    for (const auto& path : paths) {
+        totalLen += path.Len();
+        mismatches += DirNameLen(path) != BytewiseDirNameLen(path);
+        mismatches += ExtPos(path) != BytewiseExtPos(path);
+    }
+    printf("\n%d paths, %.1f bytes on average, %d mismatches\n",
+           kNumPaths, double(totalLen) / paths.size(), mismatches);
+    printf("%-28s %8s\n", "", "ns/path");
+    printf("%-28s %8.1f\n", "DirNameLen (bytewise)", NsPerPath(paths, [](StringArena*, const String& p) {
+        return BytewiseDirNameLen(p);
+    }));
+    printf("%-28s %8.1f\n", "DirNameLen", NsPerPath(paths, [](StringArena*, const String& p) {
+        return DirNameLen(p);
+    }));
+    printf("%-28s %8.1f\n", "BaseName", NsPerPath(paths, [](StringArena*, const String& p) {
+        return BaseName(p).Len();
+    }));
+    printf("%-28s %8.1f\n", "ExtPos (bytewise)", NsPerPath(paths, [](StringArena*, const String& p) {
+        return BytewiseExtPos(p);
+    }));
+    printf("%-28s %8.1f\n", "ExtPos", NsPerPath(paths, [](StringArena*, const String& p) {
+        return ExtPos(p);
+    }));
+    printf("%-28s %8.1f\n", "object path (Substring)", NsPerPath(paths, [](StringArena* arena, const String& p) {
+        String stem = Substring(arena, p, 0, BytewiseExtPos(p));
+        return FormatString(arena, "$builddir/%s.o", stem.CStr()).Len();
+    }));
+    printf("%-28s %8.1f\n", "object path (ExtPos)", NsPerPath(paths, [](StringArena* arena, const String& p) {
+        return FormatString(arena, "$builddir/%.*s.o", int(ExtPos(p)), p.CStr()).Len();
+    }));
+}
+
+int main() {
+    printf("threads  NewString  ConcatStrings  FormatString  (M allocs/s)\n");
+    for (int numThreads = 1; numThreads <= 64; numThreads *= 2) {
+        double newString = AllocsPerSecond(numThreads, [](int) {
+            NewString("$builddir/src/lib/detail/impl.o");
+        });
+        double concatStrings = AllocsPerSecond(numThreads, [](int) {
+            ConcatStrings("$root/", "src/lib/detail/impl.cpp");
+        });
+        double formatString = AllocsPerSecond(numThreads, [](int i) {
+            FormatString("src/lib%d/detail/impl.cpp", i);
+        });
+        printf("%7d  %9.1f  %13.1f  %12.1f\n", numThreads,
+               newString / 1e6, concatStrings / 1e6, formatString / 1e6);
+    }
+    BenchPaths();
+}
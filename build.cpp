@@ -16,7 +16,12 @@ Project Generate(Toolchain toolchain) {
     buildcpp.includeDirectories = {"include"};
     buildcpp.linkDirectories = { bcpp::BuildDir() };
     buildcpp.install = true;
+    // build.so links against symbols exported from the buildcpp executable
+#ifdef __APPLE__
     buildcpp.linkFlags = {"-export_dynamic"};
+#else
+    buildcpp.linkFlags = {"--export-dynamic", "--no-as-needed", "-ldl", "-lpthread"};
+#endif
 
     project.targets.emplace_back(std::move(buildcpp));
     
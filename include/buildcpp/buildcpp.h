@@ -36,21 +36,51 @@ enum class Flag {
     Off,
 };
 
+enum class LTO {
+    Full,
+    Thin, // Clang only, GCC falls back to its own partitioned LTO
+};
+
 struct Compiler {
     Standard standard   = Standard::Default;
     BuildType buildType = BuildType::Default;
     Flag exceptions     = Flag::Default;
     Flag rtti           = Flag::Default;
+    Flag lto            = Flag::Default;
+    LTO ltoMode         = LTO::Full;
+    // Maps the checkout and build directory out of __FILE__ and debug info
+    // so objects don't depend on where the project was checked out
+    Flag remapPaths     = Flag::Default;
 };
 
 struct Toolchain {
     Compiler compiler;
 };
 
-struct Target;
+enum class Visibility {
+    Private, // Only the depending target uses the dependency
+    Public,  // Targets depending on the depending target use it too
+};
+
+// A dependency on another Target in the Project, by name
 struct Dependency {
-    std::vector<String> includeDirectories;
-    std::vector<String> libraries; 
+    Dependency(const char* target, Visibility visibility = Visibility::Private)
+    : target(target), visibility(visibility) {}
+    Dependency(String target, Visibility visibility = Visibility::Private)
+    : target(target), visibility(visibility) {}
+
+    String target;
+    Visibility visibility;
+};
+
+// A file made by running a command, such as a header from a code generator
+struct GeneratedFile {
+    GeneratedFile(String output, String command, std::vector<String> inputs = {})
+    : output(output), command(command), inputs(std::move(inputs)) {}
+
+    String output;              // Relative to the build directory
+    String command;             // May use Ninja's $in and $out
+    std::vector<String> inputs; // Relative to the project root
 };
 
 struct Target {
@@ -64,12 +94,44 @@ struct Target {
     bool install = false;
     bool isDefault = true;
     std::vector<String> inputs;
+    // When > 1, inputs are compiled in unity files that each #include up to
+    // this many consecutive inputs
+    int unityBatchSize = 0;
+    // Header compiled once and force included ahead of every input
+    String precompiledHeader;
+    // Profile guided optimization for executables. An instrumented build is
+    // run with this command, where $in is the instrumented executable, and
+    // the profile it writes is used to optimize the real build.
+    String pgoTrainingCommand;
     
+    // Directories are relative to the project root unless absolute or, like
+    // "$builddir/gen", starting with a Ninja variable
     std::vector<String> includeDirectories;
     std::vector<String> linkDirectories;
 
     std::vector<String> compileFlags;
     std::vector<String> linkFlags;
+
+    // Expected peak memory in MB of linking this target, 0 for the default
+    // of 1 GB, or 4 GB with LTO. Links run in a pool sized so the largest
+    // expected links all fit in the machine's RAM at once.
+    int linkMemoryMB = 0;
+    // Inputs whose compiles need far more memory than the rest, such as
+    // template heavy code, and how much in MB, 0 for the default of 2 GB.
+    // They compile in their own pool sized the same way.
+    std::vector<String> heavyInputs;
+    int heavyInputMemoryMB = 0;
+
+    // Headers generated before anything in this target, or depending on it,
+    // compiles. Compiles only wait for the headers, never for a link.
+    std::vector<GeneratedFile> generatedHeaders;
+
+    // Libraries this target links against. Their public include directories
+    // and compile flags, and those of their public dependencies, are added to
+    // this target's own.
+    std::vector<Dependency> dependencies;
+    std::vector<String> publicIncludeDirectories;
+    std::vector<String> publicCompileFlags;
 };
 
 struct InstallHeaders {
@@ -1,13 +1,16 @@
 
 #pragma once
 
+#include <stddef.h>
+
 namespace bcpp {
 
 /*
  * Unlike std::string String is:
  *   1. Immutable
  *   2. Does not own its underlying memory
- *   3. All Strings share one underlying memory pool (String creation is not thread-safe)
+ *   3. Allocated from per-thread memory pools (String creation is thread-safe,
+ *      but a StringArena* must only be used by one thread at a time)
  *
  * Use NewString and friends to create new strings
  */
@@ -33,6 +36,35 @@ private:
     size_t len_ = 0;
 };
 
+bool operator==(const String& a, const String& b);
+bool operator!=(const String& a, const String& b);
+
+struct InternEntry;
+
+/*
+ * A handle to a deduplicated String. Interning equal Strings always yields
+ * the same handle, so comparing InternedStrings is a pointer compare and
+ * their hash is computed once. Interned Strings live for the program lifetime.
+ */
+struct InternedString {
+    InternedString() = default;
+
+    String Str() const;
+    size_t Hash() const;
+
+    bool operator==(const InternedString& other) const { return entry_ == other.entry_; }
+    bool operator!=(const InternedString& other) const { return entry_ != other.entry_; }
+
+private:
+    friend InternedString InternString(const String& str);
+    explicit InternedString(const InternEntry* entry) : entry_(entry) {}
+
+    const InternEntry* entry_ = nullptr;
+};
+
+// Thread-safe. Interning an empty String returns InternedString().
+InternedString InternString(const String& str);
+
 struct StringArena;
 struct TempStringArena;
 
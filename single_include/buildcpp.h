@@ -1,24 +1,58 @@
 
 #include <assert.h>
+#include <dirent.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h> // getcwd
 #include <fcntl.h> // open
 #include <dlfcn.h>
-#include <mach-o/dyld.h> // _NSGetExecutablePath
+#include <limits.h> // PATH_MAX
+#include <stdarg.h>
 #include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/file.h> // flock
 #include <sys/mman.h>
+#include <sys/resource.h> // wait4
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h> // _NSGetExecutablePath
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <thread>
 
 // include/buildcpp/string.h
 
+#include <stddef.h>
+
 namespace bcpp {
 
 /*
  * Unlike std::string String is:
  *   1. Immutable
  *   2. Does not own its underlying memory
- *   3. All Strings share one underlying memory pool (String creation is not thread-safe)
+ *   3. Allocated from per-thread memory pools (String creation is thread-safe,
+ *      but a StringArena* must only be used by one thread at a time)
  *
  * Use NewString and friends to create new strings
  */
@@ -44,6 +78,35 @@ private:
     size_t len_ = 0;
 };
 
+bool operator==(const String& a, const String& b);
+bool operator!=(const String& a, const String& b);
+
+struct InternEntry;
+
+/*
+ * A handle to a deduplicated String. Interning equal Strings always yields
+ * the same handle, so comparing InternedStrings is a pointer compare and
+ * their hash is computed once. Interned Strings live for the program lifetime.
+ */
+struct InternedString {
+    InternedString() = default;
+
+    String Str() const;
+    size_t Hash() const;
+
+    bool operator==(const InternedString& other) const { return entry_ == other.entry_; }
+    bool operator!=(const InternedString& other) const { return entry_ != other.entry_; }
+
+private:
+    friend InternedString InternString(const String& str);
+    explicit InternedString(const InternEntry* entry) : entry_(entry) {}
+
+    const InternEntry* entry_ = nullptr;
+};
+
+// Thread-safe. Interning an empty String returns InternedString().
+InternedString InternString(const String& str);
+
 struct StringArena;
 struct TempStringArena;
 
@@ -101,21 +164,51 @@ enum class Flag {
     Off,
 };
 
+enum class LTO {
+    Full,
+    Thin, // Clang only, GCC falls back to its own partitioned LTO
+};
+
 struct Compiler {
     Standard standard   = Standard::Default;
     BuildType buildType = BuildType::Default;
     Flag exceptions     = Flag::Default;
     Flag rtti           = Flag::Default;
+    Flag lto            = Flag::Default;
+    LTO ltoMode         = LTO::Full;
+    // Maps the checkout and build directory out of __FILE__ and debug info
+    // so objects don't depend on where the project was checked out
+    Flag remapPaths     = Flag::Default;
 };
 
 struct Toolchain {
     Compiler compiler;
 };
 
-struct Target;
+enum class Visibility {
+    Private, // Only the depending target uses the dependency
+    Public,  // Targets depending on the depending target use it too
+};
+
+// A dependency on another Target in the Project, by name
 struct Dependency {
-    std::vector<String> includeDirectories;
-    std::vector<String> libraries; 
+    Dependency(const char* target, Visibility visibility = Visibility::Private)
+    : target(target), visibility(visibility) {}
+    Dependency(String target, Visibility visibility = Visibility::Private)
+    : target(target), visibility(visibility) {}
+
+    String target;
+    Visibility visibility;
+};
+
+// A file made by running a command, such as a header from a code generator
+struct GeneratedFile {
+    GeneratedFile(String output, String command, std::vector<String> inputs = {})
+    : output(output), command(command), inputs(std::move(inputs)) {}
+
+    String output;              // Relative to the build directory
+    String command;             // May use Ninja's $in and $out
+    std::vector<String> inputs; // Relative to the project root
 };
 
 struct Target {
@@ -129,12 +222,44 @@ struct Target {
     bool install = false;
     bool isDefault = true;
     std::vector<String> inputs;
+    // When > 1, inputs are compiled in unity files that each #include up to
+    // this many consecutive inputs
+    int unityBatchSize = 0;
+    // Header compiled once and force included ahead of every input
+    String precompiledHeader;
+    // Profile guided optimization for executables. An instrumented build is
+    // run with this command, where $in is the instrumented executable, and
+    // the profile it writes is used to optimize the real build.
+    String pgoTrainingCommand;
     
+    // Directories are relative to the project root unless absolute or, like
+    // "$builddir/gen", starting with a Ninja variable
     std::vector<String> includeDirectories;
     std::vector<String> linkDirectories;
 
     std::vector<String> compileFlags;
     std::vector<String> linkFlags;
+
+    // Expected peak memory in MB of linking this target, 0 for the default
+    // of 1 GB, or 4 GB with LTO. Links run in a pool sized so the largest
+    // expected links all fit in the machine's RAM at once.
+    int linkMemoryMB = 0;
+    // Inputs whose compiles need far more memory than the rest, such as
+    // template heavy code, and how much in MB, 0 for the default of 2 GB.
+    // They compile in their own pool sized the same way.
+    std::vector<String> heavyInputs;
+    int heavyInputMemoryMB = 0;
+
+    // Headers generated before anything in this target, or depending on it,
+    // compiles. Compiles only wait for the headers, never for a link.
+    std::vector<GeneratedFile> generatedHeaders;
+
+    // Libraries this target links against. Their public include directories
+    // and compile flags, and those of their public dependencies, are added to
+    // this target's own.
+    std::vector<Dependency> dependencies;
+    std::vector<String> publicIncludeDirectories;
+    std::vector<String> publicCompileFlags;
 };
 
 struct InstallHeaders {
@@ -198,32 +323,38 @@ const char& String::operator[](size_t i) const {
     return buf_[i];
 }
 
+struct StringArenaChunk;
+
+/*
+ * A StringArena is a chain of chunks mapped on demand. Allocations bump a
+ * pointer through the current chunk and a new chunk is mapped when it runs
+ * out, so an arena never has to reserve memory up front.
+ */
 struct StringArena {
-    char* buf = nullptr;
+    char* buf = nullptr; // Current chunk
     size_t size = 0;
     size_t used = 0;
     int tempCount = 0;
+    StringArenaChunk* chunk = nullptr;
+    StringArenaChunk* spare = nullptr; // Kept around to avoid remapping in temp scopes
 };
 
 struct TempStringArena {
     StringArena* arena;
+    char* buf;
     size_t used;
 
-    ~TempStringArena() {
-        assert(arena->used >= used);
-        arena->used = used;
-        arena->tempCount--;
-        assert(arena->tempCount >= 0);
-    }
+    ~TempStringArena();
 };
 } // namespace bcpp
 
 namespace {
-static bcpp::StringArena stringArena;
-static bcpp::StringArena tempStringArena;
-
 void* VirtualAlloc(size_t len) {
-    return mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+    int flags = MAP_ANON | MAP_PRIVATE;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    return mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
 }
 
 __attribute__((__format__ (__printf__, 1, 2)))
@@ -235,40 +366,309 @@ void Fatal(const char* fmt, ...) {
     exit(1);
 }
 
-bcpp::StringArena AllocStringArena(size_t len) {
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+    __uint128_t r = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+// Fast non-cryptographic 64-bit hash, consuming 8 bytes per step
+uint64_t HashBytes(const void* data, size_t len, uint64_t seed = 0) {
+    const uint64_t k0 = 0xa0761d6478bd642full;
+    const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    const char* p = static_cast<const char*>(data);
+    uint64_t h = HashMix(seed ^ k0, len ^ k1);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = HashMix(h ^ v, k1);
+    }
+    if (len > 0) {
+        uint64_t v = 0;
+        memcpy(&v, p, len);
+        h = HashMix(h ^ v, k0);
+    }
+    return HashMix(h, k1);
+}
+
+/*
+ * Byte search helpers for paths. These scan 16 (or 32 with AVX2) bytes per
+ * step with SSE2/AVX2 on x86-64 and NEON on arm64, finishing the tail (or
+ * everything, on other targets) with a plain loop.
+ */
+
+// Returns the first c in [p, end) or nullptr
+const char* FindFirstByte(const char* p, const char* end, char c) {
+#if defined(__AVX2__)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle32));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t needle = vdupq_n_u8(c);
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), needle);
+        if (vmaxvq_u8(eq)) break; // Found in this block, locate it below
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == c) return p;
+    }
+    return nullptr;
+}
+
+// Returns the last c in [begin, end) or nullptr
+const char* FindLastByte(const char* begin, const char* end, char c) {
+#if defined(__AVX2__)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    for (; end - begin >= 32; end -= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(end - 32));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle32));
+        if (mask) return end - 32 + (31 - __builtin_clz(mask));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - begin >= 16; end -= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(end - 16));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) return end - 16 + (31 - __builtin_clz(mask));
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t needle = vdupq_n_u8(c);
+    for (; end - begin >= 16; end -= 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(end - 16)), needle);
+        if (vmaxvq_u8(eq)) break;
+    }
+#endif
+    while (end > begin) {
+        if (*--end == c) return end;
+    }
+    return nullptr;
+}
+
+// Counts the c in [p, end)
+size_t CountByte(const char* p, const char* end, char c) {
+    size_t count = 0;
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t needle = vdupq_n_u8(c);
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), needle);
+        count += vaddvq_u8(vshrq_n_u8(eq, 7));
+    }
+#endif
+    for (; p < end; p++) {
+        count += *p == c;
+    }
+    return count;
+}
+
+// Length of the common prefix of a and b, which are at least len bytes long
+size_t CommonPrefixLen(const char* a, const char* b, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; len - i >= 16; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(__aarch64__)
+    for (; len - i >= 16; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(a + i)),
+                                 vld1q_u8(reinterpret_cast<const uint8_t*>(b + i)));
+        if (vminvq_u8(eq) != 0xff) break;
+    }
+#endif
+    for (; i < len; i++) {
+        if (a[i] != b[i]) break;
+    }
+    return i;
+}
+
+static const size_t kPageSize = 4096;
+static const size_t kStringArenaChunkSize = 1024 * 1024; // 1MB
+// Temp scopes that leave more than this behind hand the pages back to the OS
+static const size_t kStringArenaReleaseSize = 256 * 1024; // 256KB
+
+static std::atomic<size_t> stringMemoryMapped(0);
+static std::atomic<size_t> stringMemoryPeak(0);
+
+// Each thread allocates program lifetime strings from its own stringArena
+// and temp strings from its own tempStringArena, so creating strings takes
+// no locks. The temp arena's memory is unmapped when its thread exits.
+struct ThreadTempStringArena {
     bcpp::StringArena arena;
-    arena.size = len;
-    arena.buf = static_cast<char*>(VirtualAlloc(len));
-    arena.tempCount = 0;
-    return arena;
+    ~ThreadTempStringArena();
+};
+static thread_local bcpp::StringArena stringArena;
+static thread_local ThreadTempStringArena tempStringArena;
+
+size_t PeakStringMemory() {
+    return stringMemoryPeak.load(std::memory_order_relaxed);
+}
+} // namespace
+
+namespace bcpp {
+struct StringArenaChunk {
+    StringArenaChunk* prev;
+    size_t size; // Including this header
+
+    char* Data() { return reinterpret_cast<char*>(this + 1); }
+    size_t DataSize() const { return size - sizeof(StringArenaChunk); }
+};
+} // namespace bcpp
+
+namespace {
+bcpp::StringArenaChunk* MapStringArenaChunk(size_t minDataSize) {
+    size_t size = sizeof(bcpp::StringArenaChunk) + minDataSize;
+    size = std::max(kStringArenaChunkSize, (size + kPageSize - 1) & ~(kPageSize - 1));
+    void* mem = VirtualAlloc(size);
+    if (mem == MAP_FAILED) {
+        Fatal("Out of memory allocating %zu bytes of strings\n", minDataSize);
+    }
+    size_t mapped = stringMemoryMapped.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = stringMemoryPeak.load(std::memory_order_relaxed);
+    while (mapped > peak && !stringMemoryPeak.compare_exchange_weak(peak, mapped)) {}
+
+    auto chunk = static_cast<bcpp::StringArenaChunk*>(mem);
+    chunk->prev = nullptr;
+    chunk->size = size;
+    return chunk;
 }
 
-bcpp::TempStringArena BeginTempStringArena() {
+void UnmapStringArenaChunk(bcpp::StringArenaChunk* chunk) {
+    stringMemoryMapped.fetch_sub(chunk->size, std::memory_order_relaxed);
+    munmap(chunk, chunk->size);
+}
+
+void PushStringArenaChunk(bcpp::StringArena* arena, size_t len) {
+    bcpp::StringArenaChunk* chunk = nullptr;
+    if (arena->spare && arena->spare->DataSize() >= len) {
+        chunk = arena->spare;
+        arena->spare = nullptr;
+    } else {
+        chunk = MapStringArenaChunk(len);
+    }
+    chunk->prev = arena->chunk;
+    arena->chunk = chunk;
+    arena->buf = chunk->Data();
+    arena->size = chunk->DataSize();
+    arena->used = 0;
+}
+
+void FreeStringArena(bcpp::StringArena* arena) {
+    while (arena->chunk) {
+        bcpp::StringArenaChunk* prev = arena->chunk->prev;
+        UnmapStringArenaChunk(arena->chunk);
+        arena->chunk = prev;
+    }
+    if (arena->spare) {
+        UnmapStringArenaChunk(arena->spare);
+    }
+    *arena = bcpp::StringArena();
+}
+
+ThreadTempStringArena::~ThreadTempStringArena() {
+    FreeStringArena(&arena);
+}
+
+bcpp::TempStringArena BeginTempStringArena(bcpp::StringArena* arena) {
     bcpp::TempStringArena temp;
-    temp.arena = &tempStringArena;
-    temp.used = temp.arena->used;
+    temp.arena = arena;
+    temp.buf = arena->buf;
+    temp.used = arena->used;
     temp.arena->tempCount++;
     return temp;
 }
 
-void InitBuildCpp() {
-    static bool bcppInit = false;
-    if (!bcppInit) {
-        bcppInit = true;
-        // >1GB of strings ought to be enough for anybody
-        stringArena = AllocStringArena(1024 * 1024 * 1024); // 1GB
-        tempStringArena = AllocStringArena(1024 * 1024 * 64); // 64MB
+bcpp::TempStringArena BeginTempStringArena() {
+    return BeginTempStringArena(&tempStringArena.arena);
+}
+
+// Rewinds arena to buf + used, unmapping chunks allocated since then
+void RewindStringArena(bcpp::StringArena* arena, char* buf, size_t used) {
+    size_t dirty = arena->used;
+    if (!buf && arena->chunk) {
+        // Rewinding an arena that started out empty keeps its first chunk
+        // instead of remapping it in the next scope
+        bcpp::StringArenaChunk* first = arena->chunk;
+        while (first->prev) first = first->prev;
+        buf = first->Data();
+    }
+    while (arena->buf != buf) {
+        bcpp::StringArenaChunk* chunk = arena->chunk;
+        assert(chunk);
+        arena->chunk = chunk->prev;
+        if (!arena->spare && chunk->size == kStringArenaChunkSize) {
+            // Keep the header page, release the rest
+            madvise(reinterpret_cast<char*>(chunk) + kPageSize, chunk->size - kPageSize, MADV_DONTNEED);
+            chunk->prev = nullptr;
+            arena->spare = chunk;
+        } else {
+            UnmapStringArenaChunk(chunk);
+        }
+        arena->buf = arena->chunk ? arena->chunk->Data() : nullptr;
+        arena->size = arena->chunk ? arena->chunk->DataSize() : 0;
+        dirty = arena->size;
+    }
+    assert(dirty >= used);
+    arena->used = used;
+
+    // Give large runs of pages freed within the current chunk back to the OS
+    if (dirty - used >= kStringArenaReleaseSize) {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(buf + used) + kPageSize - 1) & ~(kPageSize - 1);
+        uintptr_t end = reinterpret_cast<uintptr_t>(buf + dirty) & ~(kPageSize - 1);
+        if (end > start) {
+            madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+        }
     }
 }
 
 char* AllocString(bcpp::StringArena* arena, size_t len) {
-    assert(arena->used + len <= arena->size);
+    if (arena->used + len > arena->size) {
+        PushStringArenaChunk(arena, len);
+    }
     char* ret = arena->buf + arena->used; 
     arena->used += len;
     return ret;
 }
+char* AllocAligned(bcpp::StringArena* arena, size_t len, size_t align) {
+    uintptr_t next = reinterpret_cast<uintptr_t>(arena->buf + arena->used);
+    size_t padding = (align - (next & (align - 1))) & (align - 1);
+    if (arena->used + padding + len > arena->size) {
+        PushStringArenaChunk(arena, len);
+        padding = 0;
+    }
+    char* ret = arena->buf + arena->used + padding;
+    arena->used += padding + len;
+    return ret;
+}
 } // namespace
 
+namespace bcpp {
+TempStringArena::~TempStringArena() {
+    RewindStringArena(arena, buf, used);
+    arena->tempCount--;
+    assert(arena->tempCount >= 0);
+}
+} // namespace bcpp
+
 namespace bcpp {
 
 String NewString(StringArena* arena, const char* str) {
@@ -354,6 +754,97 @@ String CopyString(const String& a) {
     return NewString(a.CStr(), a.Len());
 }
 
+bool operator==(const String& a, const String& b) {
+    return a.Len() == b.Len() && memcmp(a.CStr(), b.CStr(), a.Len()) == 0;
+}
+
+bool operator!=(const String& a, const String& b) {
+    return !(a == b);
+}
+
+struct InternEntry {
+    String str;
+    size_t hash;
+};
+
+String InternedString::Str() const {
+    return entry_ ? entry_->str : String();
+}
+
+size_t InternedString::Hash() const {
+    return entry_ ? entry_->hash : 0;
+}
+
+} // namespace bcpp
+
+namespace {
+/*
+ * The intern table is split into shards by hash, each an open addressing
+ * table behind its own mutex, so threads interning different strings rarely
+ * contend. Entries and their strings live for the rest of the program.
+ */
+struct InternSlot {
+    size_t hash;
+    bcpp::InternEntry* entry;
+};
+
+struct InternShard {
+    std::mutex mutex;
+    InternSlot* slots = nullptr;
+    size_t numSlots = 0;
+    size_t numEntries = 0;
+    bcpp::StringArena arena;
+};
+static const size_t kNumInternShards = 16;
+static InternShard internShards[kNumInternShards];
+
+void GrowInternShard(InternShard* shard) {
+    size_t numSlots = shard->numSlots ? shard->numSlots * 2 : 256;
+    auto slots = static_cast<InternSlot*>(calloc(numSlots, sizeof(InternSlot)));
+    for (size_t i = 0; i < shard->numSlots; i++) {
+        if (shard->slots[i].entry) {
+            size_t slot = shard->slots[i].hash & (numSlots - 1);
+            while (slots[slot].entry) slot = (slot + 1) & (numSlots - 1);
+            slots[slot] = shard->slots[i];
+        }
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->numSlots = numSlots;
+}
+
+} // namespace
+
+namespace bcpp {
+
+InternedString InternString(const String& str) {
+    if (str.Empty()) {
+        return InternedString();
+    }
+    size_t hash = HashBytes(str.CStr(), str.Len());
+    // The low bits pick the slot, so shard by the high bits
+    InternShard& shard = internShards[hash >> (64 - 4)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.numEntries * 2 >= shard.numSlots) {
+        GrowInternShard(&shard);
+    }
+    size_t slot = hash & (shard.numSlots - 1);
+    for (; shard.slots[slot].entry; slot = (slot + 1) & (shard.numSlots - 1)) {
+        if (shard.slots[slot].hash == hash && shard.slots[slot].entry->str == str) {
+            return InternedString(shard.slots[slot].entry);
+        }
+    }
+    // Each entry is immediately followed by its characters
+    char* mem = AllocAligned(&shard.arena, sizeof(InternEntry) + str.Len() + 1, alignof(InternEntry));
+    char* buf = mem + sizeof(InternEntry);
+    memcpy(buf, str.CStr(), str.Len());
+    buf[str.Len()] = '\0';
+    auto entry = new (mem) InternEntry{String(buf, str.Len()), hash};
+    shard.slots[slot] = InternSlot{hash, entry};
+    shard.numEntries++;
+    return InternedString(entry);
+}
+
 String BuildDir() {
     return "$builddir";
 }
@@ -381,6 +872,15 @@ bool IsFile(const String& path) {
     return false;
 }
 
+// Returns 0 for files that don't exist
+size_t FileSize(const String& path) {
+    struct stat sb;
+    if (stat(path.CStr(), &sb) == 0) {
+        return sb.st_size;
+    }
+    return 0;
+}
+
 bool MakeDir(const String& dir, bool existsOk = false) {
     if (IsDir(dir) && existsOk) {
         return true;
@@ -388,6 +888,105 @@ bool MakeDir(const String& dir, bool existsOk = false) {
     return mkdir(dir.CStr(), 0777) == 0;
 }
 
+struct MappedFile {
+    const char* data = nullptr;
+    size_t len = 0;
+};
+
+// Maps a regular file read-only. Empty files succeed with a null data pointer.
+bool MapFile(const String& path, MappedFile* file) {
+    *file = MappedFile();
+    int fd = open(path.CStr(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        ok = true;
+        if (sb.st_size > 0) {
+            void* contents = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (contents != MAP_FAILED) {
+                file->data = static_cast<const char*>(contents);
+                file->len = sb.st_size;
+            } else {
+                ok = false;
+            }
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+void UnmapFile(MappedFile* file) {
+    if (file->data) {
+        munmap(const_cast<char*>(file->data), file->len);
+    }
+    *file = MappedFile();
+}
+
+bool FileContentsEqual(const String& path, const char* data, size_t len) {
+    MappedFile file;
+    if (!MapFile(path, &file)) {
+        return false;
+    }
+    bool equal = file.len == len && (len == 0 || memcmp(file.data, data, len) == 0);
+    UnmapFile(&file);
+    return equal;
+}
+
+uint64_t HashString(const String& str, uint64_t seed = 0) {
+    return HashBytes(str.CStr(), str.Len(), seed);
+}
+
+bool HashFile(const String& path, uint64_t* hash, uint64_t seed = 0) {
+    MappedFile file;
+    if (!MapFile(path, &file)) {
+        return false;
+    }
+    *hash = HashBytes(file.data, file.len, seed);
+    UnmapFile(&file);
+    return true;
+}
+
+// Replaces path with data. The data goes to a temporary file that is renamed
+// into place so nothing ever observes a partially written file.
+bool WriteFile(const String& path, const char* data, size_t len) {
+    char tempPath[PATH_MAX];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp%d", path.CStr(), int(getpid()));
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = write(fd, data + written, len - written);
+        if (ret < 0) {
+            break;
+        }
+        written += ret;
+    }
+    if (close(fd) != 0 || written != len || rename(tempPath, path.CStr()) != 0) {
+        unlink(tempPath);
+        return false;
+    }
+    return true;
+}
+
+// Like WriteFile, but leaves path and its mtime untouched when it already
+// holds exactly data
+bool WriteFileIfChanged(const String& path, const char* data, size_t len, bool* changed = nullptr) {
+    if (changed) *changed = false;
+    if (FileContentsEqual(path, data, len)) {
+        return true;
+    }
+    if (!WriteFile(path, data, len)) {
+        return false;
+    }
+    if (changed) *changed = true;
+    return true;
+}
+
 String GetCwd(StringArena* arena) {
     char buf[1024];
     if (!getcwd(buf, 1024)) {
@@ -406,6 +1005,7 @@ String GetEnv(const String& name, const String& def = "") {
     return NewString(v);
 }
 
+// Returns a view into path when it has no trailing slashes, otherwise a copy
 String BaseName(const String& path) {
     if (path.Empty()) {
         return "";
@@ -415,21 +1015,23 @@ String BaseName(const String& path) {
     while (endPos > 0 && path[endPos] == '/') {
         endPos--;
     }
-    // Look for the last slash before endPos
-    size_t lastPathSep = 0;
-    for (size_t i = 0; i < endPos; i++) {
-        if (path[i] == '/') lastPathSep = i;
+    const char* lastPathSep = FindLastByte(path.CStr(), path.CStr() + endPos, '/');
+    size_t startPos = lastPathSep ? lastPathSep - path.CStr() + 1 : 0;
+    if (endPos == path.Len() - 1) {
+        return String(path.CStr() + startPos, path.Len() - startPos);
     }
-    auto ret = Substring(path, lastPathSep+1, endPos - lastPathSep);
-    return ret;
+    return Substring(path, startPos, endPos + 1 - startPos);
+}
+
+// Length of the directory part of path, so it can be used without a copy
+// as in printf("%.*s", int(DirNameLen(path)), path.CStr())
+size_t DirNameLen(const String& path) {
+    const char* lastPathSep = FindLastByte(path.CStr(), path.CStr() + path.Len(), '/');
+    return lastPathSep ? lastPathSep - path.CStr() : 0;
 }
 
 String DirName(const String& path) {
-    size_t lastPathSep = 0;
-    for (size_t i = 0; i < path.Len(); i++) {
-        if (path[i] == '/') lastPathSep = i;
-    }
-    return Substring(path, 0, lastPathSep);
+    return Substring(path, 0, DirNameLen(path));
 }
 
 String RealPath(StringArena* arena, const String& path) {
@@ -451,20 +1053,10 @@ String RelativePath(const String& toPath, String start) {
     String absToPath = RealPath(tempMem.arena, toPath);
     String absStart = RealPath(tempMem.arena, start);
     
-    int absStartSepCount = 0;
-    for (auto c : absStart) {
-        if (c == '/') absStartSepCount++;
-    }
-
-    size_t commonPathLen = 0;
-    int commonSepCount = 0;
-    while (commonPathLen < absToPath.Len() && commonPathLen < absStart.Len()) {
-        if (absToPath[commonPathLen] != absStart[commonPathLen]) {
-            break;
-        }
-        if (absToPath[commonPathLen] == '/') commonSepCount++;
-        commonPathLen++;
-    }
+    size_t commonPathLen = CommonPrefixLen(absToPath.CStr(), absStart.CStr(),
+                                           std::min(absToPath.Len(), absStart.Len()));
+    int absStartSepCount = CountByte(absStart.CStr(), absStart.CStr() + absStart.Len(), '/');
+    int commonSepCount = CountByte(absToPath.CStr(), absToPath.CStr() + commonPathLen, '/');
     if (commonPathLen == absToPath.Len() && commonPathLen == absStart.Len()) {
         return ".";
     } 
@@ -480,12 +1072,23 @@ String RelativePath(const String& toPath, String start) {
     return CopyString(relPath);
 }
 
+// Position of the extension in path, the last dot of its final component, or
+// path.Len() if it has none. Dots in directories (as in "../" or "v1.2/")
+// and leading dots of hidden files are not treated as an extension.
+size_t ExtPos(const String& path) {
+    const char* end = path.CStr() + path.Len();
+    const char* lastPathSep = FindLastByte(path.CStr(), end, '/');
+    const char* base = lastPathSep ? lastPathSep + 1 : path.CStr();
+    while (base < end && *base == '.') ++base;
+    const char* ext = FindLastByte(base, end, '.');
+    return ext ? ext - path.CStr() : path.Len();
+}
+
+// The extension is returned as a view into path, only the stem is copied
 std::pair<String, String> SplitExt(StringArena* arena, const String& path) {
-    size_t startPos = 0;
-    while (startPos <= path.Len() && path[startPos] == '.') ++startPos;
-    size_t extPos = startPos;
-    while(extPos <= path.Len() && path[extPos] != '.') ++extPos;
-    return { Substring(arena, path, 0, extPos), Substring(arena, path, extPos) };
+    size_t extPos = ExtPos(path);
+    return { Substring(arena, path, 0, extPos),
+             String(path.CStr() + extPos, path.Len() - extPos) };
 }
 
 std::pair<String, String> SplitExt(const String& path) {
@@ -523,12 +1126,27 @@ int RunInDir(const String& cmd, const String& dir) {
     return ret;
 };
 
+double NowMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 String GetExecutablePath() {
+#ifdef __APPLE__
     uint32_t bufsize = 1024;
     char buf[bufsize];
     if (_NSGetExecutablePath(buf, &bufsize) != 0) {
         Fatal("Can't get executable path\n");
     }
+#else
+    char buf[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (len < 0) {
+        Fatal("Can't get executable path\n");
+    }
+    buf[len] = '\0';
+#endif
     return RealPath(buf);
 }
 
@@ -582,352 +1200,4172 @@ void AppendFlag(std::vector<String>& cflags, Flag flag, const String& flagName)
     }
 }
 
-void AppendCompileFlag(std::vector<String>& cflags, const String& flag) {
-    cflags.emplace_back(flag);
-}
-
-void AppendIncludeDirectory(std::vector<String>& cflags, const String& directory) {
-    cflags.emplace_back(ConcatStrings("-I$root/", directory));
+/*
+ * LTO flags go on both the compile and link lines. Code generation moves to
+ * the link, so the link also gets the build type's optimization flags, and
+ * ThinLTO caches its per-module results in $builddir/lto so relinking only
+ * redoes the modules that changed. The cache option is linker specific, so
+ * on Linux ThinLTO links with lld, the linker it's spelled for here, when
+ * lld is installed, and otherwise with the default linker and no cache.
+ */
+void AppendLTO(std::vector<String>& cflags, std::vector<String>& ldflags,
+               const Compiler& comp, bool clang, bool lld) {
+    if (comp.lto == Flag::Off) {
+        cflags.emplace_back("-fno-lto");
+        ldflags.emplace_back("-fno-lto");
+        return;
+    }
+    if (comp.lto != Flag::On) {
+        return;
+    }
+    if (!clang) {
+        cflags.emplace_back("-flto=auto");
+        ldflags.emplace_back("-flto=auto");
+    } else if (comp.ltoMode == LTO::Thin) {
+        cflags.emplace_back("-flto=thin");
+        ldflags.emplace_back("-flto=thin");
+#ifdef __APPLE__
+        ldflags.emplace_back("-Wl,-cache_path_lto,$builddir/lto");
+#else
+        if (lld) {
+            ldflags.emplace_back("-fuse-ld=lld");
+            ldflags.emplace_back("-Wl,--thinlto-cache-dir=$builddir/lto");
+        }
+#endif
+    } else {
+        cflags.emplace_back("-flto");
+        ldflags.emplace_back("-flto");
+    }
+    AppendBuildType(ldflags, comp.buildType);
 }
 
-void AppendLinkDirectory(std::vector<String>& ldflags, const String& directory) {
-    ldflags.emplace_back(ConcatStrings("-L", directory));
+// Static libraries of LTO objects need an archiver that can index bitcode
+// or GIMPLE. Apple's ar already can through libLTO.
+String ArchiverFor(const Compiler& comp, bool clang) {
+    if (comp.lto != Flag::On) {
+        return "ar";
+    }
+#ifdef __APPLE__
+    return clang ? "ar" : "gcc-ar";
+#else
+    return clang ? "llvm-ar" : "gcc-ar";
+#endif
 }
 
-void AppendLinkFlag(std::vector<String>& cflags, const String& flag) {
-    cflags.emplace_back(ConcatStrings("-Wl,", flag));
+/*
+ * Compiles run in the build directory and name sources relative to it, as
+ * $root/src/foo.cpp, so mapping $root/ away leaves root relative paths in
+ * __FILE__ and debug info. The build directory itself only shows up as the
+ * compile's working directory, which debug info records.
+ */
+void AppendRemapPaths(std::vector<String>& cflags, const Compiler& comp) {
+    if (comp.remapPaths == Flag::On) {
+        cflags.emplace_back("-ffile-prefix-map=$root/=");
+        cflags.emplace_back("-ffile-prefix-map=$$PWD=.");
+    }
 }
 
-struct NinjaVar {
-    String name;
-    std::vector<String> value;
+// Flags whose value is the next argument, like -Xclang -foo
+static const char* kSeparateValueFlags[] = {
+    "-o", "-MF", "-MT", "-MQ", "-I", "-D", "-U", "-include", "-include-pch", "-imacros", "-isystem",
+    "-iquote", "-idirafter", "-isysroot", "-Xclang", "-Xlinker", "-Xpreprocessor", "-Xassembler",
+    "-mllvm", "--param", "-x", "-arch", "-target",
 };
 
-void NinjaNewline(FILE* f) {
-    fprintf(f, "\n");
+bool TakesSeparateValue(const char* flag) {
+    if (flag[0] != '-') {
+        return false;
+    }
+    for (const char* f : kSeparateValueFlags) {
+        if (strcmp(flag, f) == 0) return true;
+    }
+    return false;
 }
 
-void NinjaComment(FILE* f, const String& comment) {
-    fprintf(f, "# %s\n", comment.CStr());
+// Header search path flags with their directory attached, like -Iinclude
+bool IsSearchPathFlag(const char* flag) {
+    for (const char* prefix : {"-I", "-isystem", "-iquote", "-idirafter"}) {
+        size_t len = strlen(prefix);
+        if (strncmp(flag, prefix, len) == 0 && flag[len] != '\0') return true;
+    }
+    return false;
 }
 
-void NinjaVariable(FILE* f, const String& name, const String& value, 
-                   const String& prefix = "") {
-    fprintf(f, "%s%s = %s\n", prefix.CStr(), name.CStr(), value.CStr());
-}
+const char* FlagCStr(const String& flag) { return flag.CStr(); }
+const char* FlagCStr(InternedString flag) { return flag.Str().CStr(); }
 
-void NinjaVariable(FILE* f, const String& name, const std::vector<String>& value,
-                   const String& prefix = "") {
-    int lineLen = 0;
-    lineLen += fprintf(f, "%s%s =", prefix.CStr(), name.CStr());
-    for (const auto& v : value) {
-        if (lineLen + v.Len() + 1 > 80) {
-            lineLen = fprintf(f, " $\n    ");
+/*
+ * Compile flags are deduplicated so the same flag coming from several places
+ * can't make otherwise identical commands differ, without changing what the
+ * compile does. Search path flags keep their first occurrence, which decides
+ * the search order. Any other flag moves to its last occurrence, so flags
+ * where the last one wins, as in -DFOO -UFOO -DFOO, keep their meaning.
+ * Flags taking a separate value, and those values, are kept as is.
+ */
+template <typename Flag>
+void AppendDeduplicatedFlag(std::vector<Flag>& cflags, const Flag& flag) {
+    const char* str = FlagCStr(flag);
+    if (TakesSeparateValue(str) || (!cflags.empty() && TakesSeparateValue(FlagCStr(cflags.back())))) {
+        cflags.push_back(flag);
+        return;
+    }
+    for (size_t i = 0; i < cflags.size(); i++) {
+        if (cflags[i] == flag && (i == 0 || !TakesSeparateValue(FlagCStr(cflags[i - 1])))) {
+            if (IsSearchPathFlag(str)) {
+                return;
+            }
+            cflags.erase(cflags.begin() + i);
+            break;
         }
-        lineLen += fprintf(f, " %s", v.CStr());
     }
-    fprintf(f, "\n");
+    cflags.push_back(flag);
 }
 
-void NinjaRule(FILE* f, const String& name, const String& command,
-                   std::vector<NinjaVar> variables = {}) {
-    fprintf(f, "rule %s\n", name.CStr());
-    fprintf(f, "  command = %s\n", command.CStr());
-    for (const auto& v : variables) {
-        NinjaVariable(f, v.name, v.value, "  ");
-    }
+void AppendCompileFlag(std::vector<String>& cflags, const String& flag) {
+    AppendDeduplicatedFlag(cflags, flag);
 }
 
-void NinjaBuild(FILE* f, const String& output, const String& rule,
-                    const std::vector<String>& inputs, const std::vector<NinjaVar> variables = {}) {
-    int lineLen = 0;
-    lineLen += fprintf(f, "build %s: %s", output.CStr(), rule.CStr());
-    for (const auto& i : inputs) {
-        if (lineLen + i.Len() + 1 > 80) {
-            lineLen = fprintf(f, " $\n    ");
-        }
-        lineLen += fprintf(f, " %s", i.CStr());
-    }
-    fprintf(f, "\n");
-    if (!variables.empty()) {
-        for (const auto& v : variables) {
-            NinjaVariable(f, v.name, v.value, "  ");
-        }
-    }
+void AppendCompileFlag(std::vector<InternedString>& cflags, InternedString flag) {
+    AppendDeduplicatedFlag(cflags, flag);
 }
 
-void NinjaDefault(FILE* f, const String& value) {
-    fprintf(f, "default %s\n", value.CStr());
+void AppendCompileFlag(std::vector<InternedString>& cflags, const String& flag) {
+    AppendDeduplicatedFlag(cflags, InternString(flag));
 }
 
-void Usage() {
-    Fatal(
-R"(usage: buildcpp [options] [builddir]
+// Absolute directories and ones starting with a Ninja variable aren't
+// relative to $root
+bool IsRootRelative(const String& path) {
+    return !path.Empty() && path[0] != '/' && path[0] != '$';
+}
 
-options:
+// Include flags are deduplicated, keeping the first occurrence since that's
+// the one that decides the search order
+void AppendIncludeDirectory(std::vector<String>& cflags, const String& directory) {
+    String flag = ConcatStrings(IsRootRelative(directory) ? "-I$root/" : "-I", directory);
+    if (std::find(cflags.begin(), cflags.end(), flag) == cflags.end()) {
+        cflags.emplace_back(flag);
+    }
+}
+
+void AppendIncludeDirectory(std::vector<InternedString>& cflags, const String& directory) {
+    auto tempMem = BeginTempStringArena();
+    InternedString flag = InternString(ConcatStrings(tempMem.arena,
+        IsRootRelative(directory) ? "-I$root/" : "-I", directory));
+    if (std::find(cflags.begin(), cflags.end(), flag) == cflags.end()) {
+        cflags.emplace_back(flag);
+    }
+}
+
+void AppendLinkDirectory(StringArena* arena, std::vector<String>& ldflags, const String& directory) {
+    ldflags.emplace_back(ConcatStrings(arena, "-L", directory));
+}
+
+void AppendLinkDirectory(std::vector<String>& ldflags, const String& directory) {
+    AppendLinkDirectory(&stringArena, ldflags, directory);
+}
+
+void AppendLinkFlag(StringArena* arena, std::vector<String>& cflags, const String& flag) {
+    cflags.emplace_back(ConcatStrings(arena, "-Wl,", flag));
+}
+
+void AppendLinkFlag(std::vector<String>& cflags, const String& flag) {
+    AppendLinkFlag(&stringArena, cflags, flag);
+}
+
+struct NinjaVar {
+    String name;
+    std::vector<String> value;
+};
+
+/*
+ * NinjaWriter accumulates a Ninja file in one contiguous buffer and writes it
+ * out with a single write() when done. Appending never parses format strings.
+ */
+struct NinjaWriter {
+    NinjaWriter() = default;
+    NinjaWriter(const NinjaWriter&) = delete;
+    NinjaWriter& operator=(const NinjaWriter&) = delete;
+    ~NinjaWriter() {
+        if (buf) {
+            munmap(buf, size);
+        }
+    }
+
+    void Append(const char* str, size_t len) {
+        if (used + len > size) {
+            Grow(used + len);
+        }
+        memcpy(buf + used, str, len);
+        used += len;
+    }
+
+    void Append(const String& str) {
+        Append(str.CStr(), str.Len());
+    }
+
+    void Clear() {
+        used = 0;
+    }
+
+    void Reserve(size_t len) {
+        if (len > size) {
+            Grow(len);
+        }
+    }
+
+    void Append(char c) {
+        if (used + 1 > size) {
+            Grow(used + 1);
+        }
+        buf[used++] = c;
+    }
+
+    // Appends " value" for each value, breaking lines that would exceed 80
+    // columns with Ninja's "$" line continuation
+    size_t AppendWrapped(size_t lineLen, const std::vector<String>& values) {
+        for (const auto& v : values) {
+            if (lineLen + v.Len() + 1 > 80) {
+                Append(" $\n    ", 7);
+                lineLen = 7;
+            }
+            Append(' ');
+            Append(v);
+            lineLen += v.Len() + 1;
+        }
+        return lineLen;
+    }
+
+    char* buf = nullptr;
+    size_t size = 0;
+    size_t used = 0;
+
+private:
+    void Grow(size_t minSize) {
+        size_t newSize = size ? size : 1024 * 1024; // 1MB
+        while (newSize < minSize) {
+            newSize *= 2;
+        }
+        char* newBuf = static_cast<char*>(VirtualAlloc(newSize));
+        if (newBuf == MAP_FAILED) {
+            Fatal("Failed to allocate %zu bytes for Ninja output\n", newSize);
+        }
+        if (buf) {
+            memcpy(newBuf, buf, used);
+            munmap(buf, size);
+        }
+        buf = newBuf;
+        size = newSize;
+    }
+};
+
+// Ninja variable and rule names may only use [a-zA-Z0-9_-]
+String NinjaIdentifier(StringArena* arena, const String& name) {
+    String id = NewString(arena, name.CStr(), name.Len());
+    char* buf = const_cast<char*>(id.CStr());
+    for (size_t i = 0; i < id.Len(); i++) {
+        char c = buf[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '_' || c == '-')) {
+            buf[i] = '_';
+        }
+    }
+    return id;
+}
+
+void NinjaNewline(NinjaWriter* w) {
+    w->Append('\n');
+}
+
+void NinjaComment(NinjaWriter* w, const String& comment) {
+    w->Append("# ", 2);
+    w->Append(comment);
+    w->Append('\n');
+}
+
+void NinjaVariable(NinjaWriter* w, const String& name, const String& value, 
+                   const String& prefix = "") {
+    w->Append(prefix);
+    w->Append(name);
+    w->Append(" = ", 3);
+    w->Append(value);
+    w->Append('\n');
+}
+
+void NinjaVariable(NinjaWriter* w, const String& name, const std::vector<String>& value,
+                   const String& prefix = "") {
+    w->Append(prefix);
+    w->Append(name);
+    w->Append(" =", 2);
+    w->AppendWrapped(prefix.Len() + name.Len() + 2, value);
+    w->Append('\n');
+}
+
+void NinjaPool(NinjaWriter* w, const String& name, size_t depth) {
+    w->Append("pool ", 5);
+    w->Append(name);
+    w->Append("\n  depth = ", 11);
+    char buf[32];
+    w->Append(buf, snprintf(buf, sizeof(buf), "%zu\n", depth));
+}
+
+void NinjaRule(NinjaWriter* w, const String& name, const String& command,
+                   const std::vector<NinjaVar>& variables = {}) {
+    w->Append("rule ", 5);
+    w->Append(name);
+    w->Append("\n  command = ", 13);
+    w->Append(command);
+    w->Append('\n');
+    for (const auto& v : variables) {
+        NinjaVariable(w, v.name, v.value, "  ");
+    }
+}
+
+void NinjaBuild(NinjaWriter* w, const String& output, const String& rule,
+                    const std::vector<String>& inputs, const std::vector<NinjaVar>& variables = {},
+                    const std::vector<String>& implicitInputs = {},
+                    const std::vector<String>& orderOnlyInputs = {}) {
+    w->Append("build ", 6);
+    w->Append(output);
+    w->Append(": ", 2);
+    w->Append(rule);
+    size_t lineLen = w->AppendWrapped(output.Len() + rule.Len() + 8, inputs);
+    if (!implicitInputs.empty()) {
+        lineLen = w->AppendWrapped(lineLen, {"|"});
+        lineLen = w->AppendWrapped(lineLen, implicitInputs);
+    }
+    if (!orderOnlyInputs.empty()) {
+        lineLen = w->AppendWrapped(lineLen, {"||"});
+        w->AppendWrapped(lineLen, orderOnlyInputs);
+    }
+    w->Append('\n');
+    if (!variables.empty()) {
+        for (const auto& v : variables) {
+            NinjaVariable(w, v.name, v.value, "  ");
+        }
+    }
+}
+
+void NinjaSubninja(NinjaWriter* w, const String& path) {
+    w->Append("subninja ", 9);
+    w->Append(path);
+    w->Append('\n');
+}
+
+void NinjaDefault(NinjaWriter* w, const String& value) {
+    w->Append("default ", 8);
+    w->Append(value);
+    w->Append('\n');
+}
+
+// Returns the prerequisites listed in a Makefile style depfile as written by
+// -MD, unescaping "\\ " in paths and skipping line continuations
+std::vector<String> ParseDepfile(StringArena* arena, const char* data, size_t len) {
+    std::vector<String> deps;
+    const char* end = data + len;
+    const char* p = data;
+    // Skip the target, up to the first colon followed by whitespace
+    p = FindFirstByte(p, end, ':');
+    while (p && p + 1 < end && p[1] != ' ' && p[1] != '\n') {
+        p = FindFirstByte(p + 1, end, ':');
+    }
+    p = p ? p + 1 : end;
+
+    char path[PATH_MAX];
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' ||
+                           (*p == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r')))) {
+            p += (*p == '\\') ? 2 : 1;
+        }
+        size_t pathLen = 0;
+        while (p < end && *p != ' ' && *p != '\n' && *p != '\r') {
+            if (*p == '\\' && p + 1 < end && p[1] == ' ') {
+                p++;
+            } else if (*p == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r')) {
+                break;
+            }
+            if (pathLen + 1 < sizeof(path)) {
+                path[pathLen++] = *p;
+            }
+            p++;
+        }
+        if (pathLen > 0) {
+            deps.emplace_back(NewString(arena, path, pathLen));
+        }
+    }
+    return deps;
+}
+
+// Finds the executable cxx resolves to on PATH
+String FindProgram(StringArena* arena, const String& program) {
+    if (FindFirstByte(program.CStr(), program.CStr() + program.Len(), '/')) {
+        return program;
+    }
+    String path = GetEnv("PATH");
+    const char* start = path.CStr();
+    const char* pathEnd = start + path.Len();
+    while (start < pathEnd) {
+        const char* end = FindFirstByte(start, pathEnd, ':');
+        size_t dirLen = (end ? end : pathEnd) - start;
+        String candidate = FormatString(arena, "%.*s/%s", int(dirLen), start, program.CStr());
+        if (access(candidate.CStr(), X_OK) == 0) {
+            return candidate;
+        }
+        if (!end) break;
+        start = end + 1;
+    }
+    return program;
+}
+
+// Identifies an executable by its path, size and modification time rather
+// than hashing all of it
+bool HashProgram(const String& path, uint64_t* h) {
+    struct stat sb;
+    if (stat(path.CStr(), &sb) != 0) {
+        return false;
+    }
+    uint64_t identity[2] = {uint64_t(sb.st_size), uint64_t(sb.st_mtime)};
+    *h = HashBytes(identity, sizeof(identity), HashString(path, *h));
+    return true;
+}
+
+timespec ModTime(const String& path) {
+    struct stat sb;
+    if (stat(path.CStr(), &sb) != 0) {
+        return timespec{};
+    }
+#ifdef __APPLE__
+    return sb.st_mtimespec;
+#else
+    return sb.st_mtim;
+#endif
+}
+
+bool TimeBefore(timespec a, timespec b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+timespec WallTime() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts;
+}
+
+// Hashes everything that could change the output of a compile: the command,
+// the compiler and buildcpp executables and every file the previous compile
+// recorded in its depfile. Fails if any of those files was modified at or
+// after modifiedBefore, when given.
+bool CompileCacheKey(const String& buildDir, const String& depfileName, const String& cmd,
+                     const String& cxx, const String& exePath, uint64_t* key,
+                     timespec modifiedBefore = {}) {
+    auto tempMem = BeginTempStringArena();
+
+    uint64_t h = HashString(cmd);
+    for (const String& exe : {FindProgram(tempMem.arena, cxx), exePath}) {
+        if (!HashProgram(exe, &h)) {
+            return false;
+        }
+    }
+
+    MappedFile depfile;
+    if (!MapFile(FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), depfileName.CStr()), &depfile)) {
+        return false;
+    }
+    auto deps = ParseDepfile(tempMem.arena, depfile.data, depfile.len);
+    UnmapFile(&depfile);
+    if (deps.empty()) {
+        return false;
+    }
+    for (const auto& dep : deps) {
+        String path = dep[0] == '/' ? dep : FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), dep.CStr());
+        if (modifiedBefore.tv_sec && !TimeBefore(ModTime(path), modifiedBefore)) {
+            return false;
+        }
+        if (!HashFile(path, &h, HashString(dep, h))) {
+            return false;
+        }
+    }
+    *key = h;
+    return true;
+}
+
+// A .key file holds the cache key of a compile output and how long it took
+bool ReadCacheKey(const String& keyFile, uint64_t* key, double* compileMs) {
+    FILE* f = fopen(keyFile.CStr(), "r");
+    if (!f) {
+        return false;
+    }
+    unsigned long long k = 0;
+    bool ok = fscanf(f, "%llx %lf", &k, compileMs) == 2;
+    fclose(f);
+    *key = k;
+    return ok;
+}
+
+void WriteCacheKey(const String& keyFile, uint64_t key, double compileMs) {
+    FILE* f = fopen(keyFile.CStr(), "w");
+    if (f) {
+        fprintf(f, "%016llx %.0f\n", static_cast<unsigned long long>(key), compileMs);
+        fclose(f);
+    }
+}
+
+/*
+ * Checks output against its .key file. The key is computed here, before the
+ * compile runs, and handed back through key (0 if it couldn't be computed) so
+ * UpdateCacheKey can fall back to it. On a miss the stale .key file is removed
+ * so an interrupted compile never leaves an old key next to a new output.
+ */
+bool CompileUpToDate(const String& buildDir, const String& output, const String& depfileName,
+                     const String& cmd, const String& cxx, const String& exePath, double* compileMs,
+                     uint64_t* key) {
+    auto tempMem = BeginTempStringArena();
+    String keyFile = FormatString(tempMem.arena, "%s/%s.key", buildDir.CStr(), output.CStr());
+    uint64_t cachedKey = 0;
+    *key = 0;
+    bool haveKey = CompileCacheKey(buildDir, depfileName, cmd, cxx, exePath, key);
+    if (haveKey && IsFile(FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), output.CStr())) &&
+        ReadCacheKey(keyFile, &cachedKey, compileMs) && *key == cachedKey) {
+        return true;
+    }
+    unlink(keyFile.CStr());
+    return false;
+}
+
+double RunCompile(const String& cmd, const String& buildDir) {
+    double compileStart = NowMs();
+    if (RunInDir(cmd, buildDir) != 0) {
+        Fatal("Failed to run %s\n", cmd.CStr());
+    }
+    return NowMs() - compileStart;
+}
+
+/*
+ * Records the key of a finished compile. Inputs are hashed again to pick up a
+ * changed dependency list, but only trusted if none of them was touched since
+ * the compile started; otherwise the key computed before the compile is kept,
+ * which can only cause a spurious rebuild, never a stale hit.
+ */
+void UpdateCacheKey(const String& buildDir, const String& output, const String& depfileName,
+                    const String& cmd, const String& cxx, const String& exePath, uint64_t key,
+                    timespec compileStart, double compileMs) {
+    auto tempMem = BeginTempStringArena();
+    uint64_t newKey = 0;
+    if (CompileCacheKey(buildDir, depfileName, cmd, cxx, exePath, &newKey, compileStart)) {
+        key = newKey;
+    }
+    if (key) {
+        WriteCacheKey(FormatString(tempMem.arena, "%s/%s.key", buildDir.CStr(), output.CStr()), key, compileMs);
+    }
+}
+
+void WriteDepfile(const String& path, const String& target, const std::vector<String>& deps) {
+    NinjaWriter w;
+    w.Append(target);
+    w.Append(':');
+    for (const auto& dep : deps) {
+        w.Append(" \\\n ", 4);
+        for (auto c : dep) {
+            if (c == '\0') break;
+            if (c == ' ') w.Append('\\');
+            w.Append(c);
+        }
+    }
+    w.Append('\n');
+    if (!WriteFileIfChanged(path, w.buf, w.used)) {
+        Fatal("Failed to write %s\n", path.CStr());
+    }
+}
+
+/*
+ * build.so calls back into the buildcpp executable, so the executable exports
+ * its symbols (-export_dynamic on macOS, -rdynamic on Linux) and build.so is
+ * linked with them left undefined. Linux shared libraries already allow
+ * undefined symbols but need position independent code.
+ */
+#ifdef __APPLE__
+static const char kBuildLibCompileFlags[] = "";
+static const char kBuildLibLinkFlags[] = " -Wl,-undefined,dynamic_lookup";
+#else
+static const char kBuildLibCompileFlags[] = " -fPIC";
+static const char kBuildLibLinkFlags[] = "";
+#endif
+
+/*
+ * Compiles build.cpp into buildDir/build.so unless the previous build.so is
+ * still current. build.cpp runs once per generation so it is compiled without
+ * optimizations, and against a precompiled header of buildcpp.h and the STL
+ * so most of the compile is spent in the project's own code.
+ */
+void CompileBuildLib(const String& buildDir, const String& relativeRoot, const String& cxx,
+                     const String& exePath, bool debugInfo) {
+    auto tempMem = BeginTempStringArena();
+
+    // build.cpp defines BUILDCPP_ENTRY before including buildcpp.h, which by
+    // then already comes from the precompiled header, so define it up front
+    String flags = FormatString(tempMem.arena, "-std=c++17 -O0%s%s -DBUILDCPP_ENTRY= -I%.*s/../include",
+                                debugInfo ? " -g" : "", kBuildLibCompileFlags,
+                                int(DirNameLen(exePath)), exePath.CStr());
+    String buildLibCmd = FormatString(tempMem.arena,
+        "%s %s -shared%s -include bcpp_pch.h -MD -MF build.so.d %s/build.cpp -o build.so",
+        cxx.CStr(), flags.CStr(), kBuildLibLinkFlags, relativeRoot.CStr());
+
+    double compileMs = 0;
+    uint64_t buildLibKey = 0;
+    if (CompileUpToDate(buildDir, "build.so", "build.so.d", buildLibCmd, cxx, exePath, &compileMs,
+                        &buildLibKey)) {
+        printf("bcpp: build.so cache hit, saved %.0f ms\n", compileMs);
+        return;
+    }
+
+    // GCC and Clang both pick up bcpp_pch.h.gch in place of -include bcpp_pch.h
+    const char pchHeader[] = "#include <vector>\n#include <buildcpp/buildcpp.h>\n";
+    String pchHeaderPath = ConcatStrings(tempMem.arena, buildDir, "/bcpp_pch.h");
+    if (!WriteFileIfChanged(pchHeaderPath, pchHeader, sizeof(pchHeader) - 1)) {
+        Fatal("Failed to write %s\n", pchHeaderPath.CStr());
+    }
+    String pchCmd = FormatString(tempMem.arena,
+        "%s %s -x c++-header -MD -MF bcpp_pch.h.d bcpp_pch.h -o bcpp_pch.h.gch", cxx.CStr(), flags.CStr());
+    double pchMs = 0;
+    uint64_t pchKey = 0;
+    if (!CompileUpToDate(buildDir, "bcpp_pch.h.gch", "bcpp_pch.h.d", pchCmd, cxx, exePath, &pchMs, &pchKey)) {
+        timespec pchStart = WallTime();
+        pchMs = RunCompile(pchCmd, buildDir);
+        UpdateCacheKey(buildDir, "bcpp_pch.h.gch", "bcpp_pch.h.d", pchCmd, cxx, exePath, pchKey, pchStart, pchMs);
+        printf("bcpp: precompiled bcpp_pch.h in %.0f ms\n", pchMs);
+    }
+
+    timespec compileStart = WallTime();
+    compileMs = RunCompile(buildLibCmd, buildDir);
+
+    // Compiles using a precompiled header don't list the header's own
+    // dependencies, so merge them back in for Ninja and the build.so cache key
+    std::vector<String> deps;
+    for (const char* depfileName : {"build.so.d", "bcpp_pch.h.d"}) {
+        MappedFile depfile;
+        if (MapFile(FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), depfileName), &depfile)) {
+            auto fileDeps = ParseDepfile(tempMem.arena, depfile.data, depfile.len);
+            deps.insert(deps.end(), fileDeps.begin(), fileDeps.end());
+            UnmapFile(&depfile);
+        }
+    }
+    WriteDepfile(ConcatStrings(tempMem.arena, buildDir, "/build.so.d"), "build.so", deps);
+
+    UpdateCacheKey(buildDir, "build.so", "build.so.d", buildLibCmd, cxx, exePath, buildLibKey, compileStart,
+                   compileMs);
+    printf("bcpp: build.so cache miss, compiled in %.0f ms\n", compileMs);
+}
+
+/*
+ * Fails on targets whose names are the same once NinjaIdentifier replaces
+ * their punctuation, such as "a.b" and "a_b", which would otherwise share
+ * rules and output directories.
+ */
+void CheckTargetIdentifiers(const std::vector<Target>& targets) {
+    // Sorting hashes finds candidates without keeping every identifier around
+    std::vector<std::pair<uint64_t, size_t>> ids;
+    ids.reserve(targets.size());
+    for (size_t t = 0; t < targets.size(); t++) {
+        auto tempMem = BeginTempStringArena();
+        ids.emplace_back(HashString(NinjaIdentifier(tempMem.arena, targets[t].name)), t);
+    }
+    std::sort(ids.begin(), ids.end());
+    for (size_t i = 1; i < ids.size(); i++) {
+        if (ids[i].first != ids[i - 1].first) continue;
+        auto tempMem = BeginTempStringArena();
+        const String& a = targets[ids[i - 1].second].name;
+        const String& b = targets[ids[i].second].name;
+        String id = NinjaIdentifier(tempMem.arena, a);
+        if (strcmp(a.CStr(), b.CStr()) == 0) {
+            Fatal("More than one target is named \"%s\"\n", a.CStr());
+        } else if (strcmp(id.CStr(), NinjaIdentifier(tempMem.arena, b).CStr()) == 0) {
+            Fatal("Targets \"%s\" and \"%s\" are both written to Ninja as %s, rename one of them\n",
+                  a.CStr(), b.CStr(), id.CStr());
+        }
+    }
+}
+
+void NinjaCxxRule(NinjaWriter* ninja, StringArena* arena, const String& name, const String& cflags) {
+    String command = FormatString(arena, "$cxx -MD -MF $out.d %s -c $in -o $out", cflags.CStr());
+    NinjaRule(ninja, name, command,
+              {{"description", {"CXX $out"}}, {"depfile", {"$out.d"}}, {"deps", {"gcc"}}});
+}
+
+void NinjaPchRule(NinjaWriter* ninja, StringArena* arena, const String& name, const String& cflags) {
+    String command = FormatString(arena, "$cxx -MD -MF $out.d %s -x c++-header -c $in -o $out",
+                                  cflags.CStr());
+    NinjaRule(ninja, name, command,
+              {{"description", {"PCH $out"}}, {"depfile", {"$out.d"}}, {"deps", {"gcc"}}});
+}
+
+// Clang and GCC name and consume precompiled headers differently
+bool IsClang(const String& cxx) {
+    auto tempMem = BeginTempStringArena();
+    return Run(FormatString(tempMem.arena, "%s -dM -E -x c++ /dev/null 2>/dev/null | grep -q __clang__",
+                            cxx.CStr())) == 0;
+}
+
+// Whether lld, whose options the ThinLTO cache is spelled with, is on PATH
+bool HasLld() {
+    auto tempMem = BeginTempStringArena();
+    return FindProgram(tempMem.arena, "ld.lld") != "ld.lld";
+}
+/*
+ * Shared libraries are compiled as position independent code and record
+ * their file name as their soname (install name on macOS). Anything linking
+ * one looks for it next to itself and, once installed, in ../lib.
+ */
+static const char kPicFlag[] = "-fPIC";
+#ifdef __APPLE__
+static const char kSharedLinkFlags[] = "-dynamiclib -Wl,-install_name,@rpath/";
+static const char kSharedLibRPath[] = "-Wl,-rpath,@loader_path -Wl,-rpath,@loader_path/../lib";
+#else
+static const char kSharedLinkFlags[] = "-shared -Wl,-soname,";
+static const char kSharedLibRPath[] = "-Wl,-rpath,'$$ORIGIN:$$ORIGIN/../lib'";
+#endif
+
+struct TargetOutput {
+    String path;
+    String rule;
+    String installDir;
+};
+
+TargetOutput GetTargetOutput(StringArena* arena, const Target& target) {
+    TargetOutput out;
+    switch (target.type) {
+        case TargetType::Executable:
+            out.path = target.name;
+            out.rule = "link";
+            out.installDir = "bin";
+            break;
+        case TargetType::StaticLibrary:
+            out.path = ConcatStrings(arena, target.name, ".a");
+            out.rule = "ar";
+            out.installDir = "lib";
+            break;
+        case TargetType::SharedLibrary:
+            out.path = ConcatStrings(arena, target.name, ".so");
+            out.rule = "link";
+            out.installDir = "lib";
+            break;
+        case TargetType::MacOSBundle:
+            Fatal("MacOSBundle target type not implemented yet\n");
+            break;
+    }
+    return out;
+}
+
+// Open addressing map from InternedString to an index, sized up front for
+// at most maxEntries keys
+struct InternedIndexMap {
+    explicit InternedIndexMap(size_t maxEntries) {
+        size_t numSlots = 16;
+        while (numSlots < maxEntries * 2) numSlots *= 2;
+        slots.resize(numSlots);
+    }
+
+    // Returns the slot for key, whose first is InternedString() if absent
+    std::pair<InternedString, size_t>& Find(InternedString key) {
+        size_t mask = slots.size() - 1;
+        size_t slot = key.Hash() & mask;
+        while (slots[slot].first != InternedString() && slots[slot].first != key) {
+            slot = (slot + 1) & mask;
+        }
+        return slots[slot];
+    }
+
+    std::vector<std::pair<InternedString, size_t>> slots;
+};
+
+// Where $builddir points, relative to the build directory
+static const char kNinjaBuildDir[] = "bcppout";
+
+// A target's compile flags and object files, interned so they can be
+// compared across targets by pointer
+struct TargetObjects {
+    std::vector<InternedString> cflags;
+    std::vector<InternedString> objects;
+    // False where an earlier target with identical cflags builds the object
+    std::vector<bool> buildsObject;
+    // For unity builds, the indices of the inputs each object includes
+    std::vector<std::vector<size_t>> unityBatches;
+    // The precompiled header every object depends on and the flag that uses it
+    InternedString pch;
+    InternedString pchFlag;
+    // False where an earlier target with identical cflags builds the PCH
+    bool buildsPch = false;
+    // Libraries to link, each before the libraries it depends on
+    std::vector<String> libs;
+    // Whether any of libs is a shared library, found at run time through
+    // the output's rpath
+    bool linksSharedLibs = false;
+    // Phony edges for the generated headers of this target and its
+    // dependencies, which compiles must wait for
+    std::vector<String> generatedHeaders;
+    // True for objects compiling any of the target's heavyInputs, or that
+    // needed a lot of memory last time they were built
+    std::vector<bool> heavy;
+    // From the edge profile: the order to write compile edges in, slowest
+    // first, and the peak memory of the heaviest compile and of the link
+    std::vector<size_t> compileOrder;
+    int heavyMemoryMB = 0;
+    int linkMemoryMB = 0;
+};
+
+// Phony edge standing for all of a target's generated headers
+String GeneratedHeadersPhony(StringArena* arena, const Target& target) {
+    return FormatString(arena, "$builddir/%s/generated", NinjaIdentifier(arena, target.name).CStr());
+}
+
+/*
+ * Resolves each target's dependencies to target indices, failing on unknown
+ * names and cycles. Returns the targets in dependency order, every target
+ * after all of its dependencies.
+ */
+std::vector<size_t> SortTargetDependencies(const std::vector<Target>& targets,
+                                           std::vector<std::vector<size_t>>* deps) {
+    InternedIndexMap targetIndices(targets.size());
+    for (size_t t = 0; t < targets.size(); t++) {
+        auto& slot = targetIndices.Find(InternString(targets[t].name));
+        if (slot.first != InternedString()) {
+            Fatal("More than one target is named \"%s\"\n", targets[t].name.CStr());
+        }
+        slot = {InternString(targets[t].name), t};
+    }
+
+    deps->assign(targets.size(), {});
+    for (size_t t = 0; t < targets.size(); t++) {
+        for (const auto& dep : targets[t].dependencies) {
+            auto& slot = targetIndices.Find(InternString(dep.target));
+            if (slot.first == InternedString()) {
+                Fatal("Target \"%s\" depends on unknown target \"%s\"\n",
+                      targets[t].name.CStr(), dep.target.CStr());
+            }
+            if (targets[slot.second].type == TargetType::Executable) {
+                Fatal("Target \"%s\" depends on executable \"%s\"\n",
+                      targets[t].name.CStr(), dep.target.CStr());
+            }
+            (*deps)[t].push_back(slot.second);
+        }
+    }
+
+    // Depth first, emitting each target once its dependencies are done
+    enum { Unvisited, Visiting, Done };
+    std::vector<char> state(targets.size(), Unvisited);
+    std::vector<size_t> order;
+    order.reserve(targets.size());
+    std::vector<std::pair<size_t, size_t>> stack; // (target, next dependency)
+    for (size_t root = 0; root < targets.size(); root++) {
+        if (state[root] != Unvisited) continue;
+        stack.emplace_back(root, 0);
+        state[root] = Visiting;
+        while (!stack.empty()) {
+            auto& top = stack.back();
+            if (top.second < (*deps)[top.first].size()) {
+                size_t dep = (*deps)[top.first][top.second++];
+                if (state[dep] == Visiting) {
+                    Fatal("Dependency cycle between targets \"%s\" and \"%s\"\n",
+                          targets[top.first].name.CStr(), targets[dep].name.CStr());
+                }
+                if (state[dep] == Unvisited) {
+                    state[dep] = Visiting;
+                    stack.emplace_back(dep, 0);
+                }
+            } else {
+                state[top.first] = Done;
+                order.push_back(top.first);
+                stack.pop_back();
+            }
+        }
+    }
+    return order;
+}
+
+/*
+ * Deduplicates flags the way appending them one at a time with
+ * AppendDeduplicatedFlag would, but in one pass, so flags gathered from many
+ * dependencies don't each scan everything gathered before them.
+ */
+void DeduplicateFlags(std::vector<InternedString>& cflags) {
+    InternedIndexMap lastSeen(cflags.size());
+    std::vector<bool> keep(cflags.size(), true);
+    for (size_t i = 0; i < cflags.size(); i++) {
+        const char* str = cflags[i].Str().CStr();
+        if (TakesSeparateValue(str) || (i > 0 && TakesSeparateValue(cflags[i - 1].Str().CStr()))) {
+            continue;
+        }
+        auto& slot = lastSeen.Find(cflags[i]);
+        if (slot.first == InternedString()) {
+            slot = {cflags[i], i};
+        } else if (IsSearchPathFlag(str)) {
+            keep[i] = false;
+        } else {
+            keep[slot.second] = false;
+            slot.second = i;
+        }
+    }
+    size_t numKept = 0;
+    for (size_t i = 0; i < cflags.size(); i++) {
+        if (keep[i]) cflags[numKept++] = cflags[i];
+    }
+    cflags.resize(numKept);
+}
+
+/*
+ * Works out what each target passes on to its dependents: the compile flags
+ * for its public include directories, public compile flags and everything
+ * its public dependencies pass on, and the libraries to link, which for a
+ * static library includes every library it depends on. Shared libraries
+ * already contain their dependencies so only pass on themselves.
+ */
+void PropagateTargetDependencies(const std::vector<Target>& targets,
+                                 std::vector<TargetObjects>* plan) {
+    bool anyDependencies = false;
+    for (size_t t = 0; t < targets.size(); t++) {
+        anyDependencies |= !targets[t].dependencies.empty();
+    }
+    if (!anyDependencies) {
+        // Nothing to sort or pass on, each target just uses its public flags
+        for (size_t t = 0; t < targets.size(); t++) {
+            if (!targets[t].generatedHeaders.empty()) {
+                (*plan)[t].generatedHeaders.emplace_back(GeneratedHeadersPhony(&stringArena, targets[t]));
+            }
+            for (const auto& dir : targets[t].publicIncludeDirectories) {
+                AppendIncludeDirectory((*plan)[t].cflags, dir);
+            }
+            for (const auto& flag : targets[t].publicCompileFlags) {
+                AppendCompileFlag((*plan)[t].cflags, flag);
+            }
+        }
+        return;
+    }
+
+    std::vector<std::vector<size_t>> deps;
+    std::vector<size_t> order = SortTargetDependencies(targets, &deps);
+
+    std::vector<std::vector<InternedString>> publicFlags(targets.size());
+    std::vector<std::vector<size_t>> linkLibs(targets.size()); // Dependents first
+    std::vector<bool> inLibs(targets.size());
+    InternedString pic = InternString(kPicFlag);
+    for (size_t t : order) {
+        const Target& target = targets[t];
+        TargetObjects& objs = (*plan)[t];
+        for (const auto& dir : target.publicIncludeDirectories) {
+            AppendIncludeDirectory(publicFlags[t], dir);
+        }
+        for (const auto& flag : target.publicCompileFlags) {
+            AppendCompileFlag(publicFlags[t], flag);
+        }
+
+        std::vector<size_t> libs;
+        for (size_t d = 0; d < deps[t].size(); d++) {
+            size_t dep = deps[t][d];
+            if (target.dependencies[d].visibility == Visibility::Public) {
+                publicFlags[t].insert(publicFlags[t].end(), publicFlags[dep].begin(), publicFlags[dep].end());
+            }
+            libs.insert(libs.end(), linkLibs[dep].begin(), linkLibs[dep].end());
+            for (const auto& phony : (*plan)[dep].generatedHeaders) {
+                if (std::find(objs.generatedHeaders.begin(), objs.generatedHeaders.end(), phony) ==
+                    objs.generatedHeaders.end()) {
+                    objs.generatedHeaders.push_back(phony);
+                }
+            }
+        }
+        if (!target.generatedHeaders.empty()) {
+            objs.generatedHeaders.insert(objs.generatedHeaders.begin(),
+                                         GeneratedHeadersPhony(&stringArena, target));
+        }
+        DeduplicateFlags(publicFlags[t]);
+        // Every library has to come after everything depending on it. Each
+        // dependency's list already does, so keeping only the last occurrence
+        // of each library keeps that true for the whole line.
+        size_t firstKept = libs.size();
+        for (size_t i = libs.size(); i-- > 0;) {
+            if (!inLibs[libs[i]]) {
+                inLibs[libs[i]] = true;
+                libs[--firstKept] = libs[i];
+            }
+        }
+        libs.erase(libs.begin(), libs.begin() + firstKept);
+        for (size_t lib : libs) {
+            inLibs[lib] = false;
+        }
+
+        // This target compiles with its own public flags and its dependencies'
+        objs.cflags.insert(objs.cflags.end(), publicFlags[t].begin(), publicFlags[t].end());
+        for (size_t d = 0; d < deps[t].size(); d++) {
+            const auto& depFlags = publicFlags[deps[t][d]];
+            objs.cflags.insert(objs.cflags.end(), depFlags.begin(), depFlags.end());
+        }
+        DeduplicateFlags(objs.cflags);
+
+        if (target.type != TargetType::StaticLibrary) {
+            for (size_t lib : libs) {
+                objs.libs.emplace_back(GetTargetOutput(&stringArena, targets[lib]).path);
+                objs.linksSharedLibs |= targets[lib].type == TargetType::SharedLibrary;
+            }
+        }
+        switch (target.type) {
+            case TargetType::StaticLibrary:
+                linkLibs[t].push_back(t);
+                linkLibs[t].insert(linkLibs[t].end(), libs.begin(), libs.end());
+                break;
+            case TargetType::SharedLibrary:
+                linkLibs[t].push_back(t);
+                // Static libraries end up inside the shared library, so
+                // need position independent code as well
+                for (size_t lib : libs) {
+                    auto& libCFlags = (*plan)[lib].cflags;
+                    if (targets[lib].type == TargetType::StaticLibrary &&
+                        std::find(libCFlags.begin(), libCFlags.end(), pic) == libCFlags.end()) {
+                        libCFlags.push_back(pic);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Splits a target's inputs into unity batches of unityBatchSize consecutive
+ * inputs, the last batch taking what's left. Batches only depend on the
+ * order of inputs, so editing a source never moves it, or the sources around
+ * it, into another batch.
+ */
+std::vector<std::vector<size_t>> PlanUnityBatches(const Target& target) {
+    const size_t batchSize = target.unityBatchSize;
+    std::vector<std::vector<size_t>> batches((target.inputs.size() + batchSize - 1) / batchSize);
+    for (size_t i = 0; i < target.inputs.size(); i++) {
+        batches[i / batchSize].push_back(i);
+    }
+    return batches;
+}
+
+// A PGO target's instrumented ("pgo-gen") and optimized ("pgo-use") objects
+// have the same paths relative to these directories, which is how GCC
+// matches up their profiles
+String PgoObjectDir(StringArena* arena, const Target& target, const char* variant) {
+    return FormatString(arena, "$builddir/%s/%s", NinjaIdentifier(arena, target.name).CStr(), variant);
+}
+
+// Unity files and their objects are named $builddir/<target>/unity_<batch>
+String UnityName(StringArena* arena, const Target& target, size_t batch) {
+    return FormatString(arena, "%s/unity_%zu", NinjaIdentifier(arena, target.name).CStr(), batch);
+}
+
+/*
+ * Works out every target's objects up front. Targets in a project share most
+ * of their include directories and flags, so interning keeps one copy of each
+ * and lets targets that compile the same source with the same flags share the
+ * object file instead of generating conflicting Ninja edges.
+ */
+std::vector<TargetObjects> PlanTargetObjects(const std::vector<Target>& targets, bool clang) {
+    std::vector<TargetObjects> plan(targets.size());
+    // Targets that build a PCH, few enough to search linearly
+    std::vector<size_t> pchOwners;
+
+    // Object files and the first target building each, as an index into
+    // owners along with the source it compiles
+    size_t numObjects = 0;
+    for (const auto& target : targets) {
+        numObjects += target.inputs.size();
+    }
+    InternedIndexMap objectOwners(numObjects);
+    std::vector<std::pair<size_t, const String*>> owners;
+
+    for (size_t t = 0; t < targets.size(); t++) {
+        const Target& target = targets[t];
+        TargetObjects& objs = plan[t];
+        objs.cflags.reserve(target.includeDirectories.size() + target.compileFlags.size());
+        for (const auto& dir : target.includeDirectories) {
+            AppendIncludeDirectory(objs.cflags, dir);
+        }
+        for (const auto& flag : target.compileFlags) {
+            AppendCompileFlag(objs.cflags, flag);
+        }
+        if (target.type == TargetType::SharedLibrary) {
+            objs.cflags.emplace_back(InternString(kPicFlag));
+        }
+    }
+    PropagateTargetDependencies(targets, &plan);
+
+    for (size_t t = 0; t < targets.size(); t++) {
+        auto tempMem = BeginTempStringArena();
+        const Target& target = targets[t];
+        TargetObjects& objs = plan[t];
+
+        if (!target.precompiledHeader.Empty()) {
+            InternedString header = InternString(target.precompiledHeader);
+            for (size_t owner : pchOwners) {
+                if (targets[owner].precompiledHeader == header.Str() && plan[owner].cflags == objs.cflags) {
+                    objs.pch = plan[owner].pch;
+                    objs.pchFlag = plan[owner].pchFlag;
+                    break;
+                }
+            }
+            if (objs.pch == InternedString()) {
+                // GCC finds <header>.gch next to the -include'd name by itself
+                String pchBase = FormatString(tempMem.arena, "$builddir/%s/pch/%s",
+                                              NinjaIdentifier(tempMem.arena, target.name).CStr(),
+                                              BaseName(header.Str()).CStr());
+                objs.pch = InternString(ConcatStrings(tempMem.arena, pchBase, clang ? ".pch" : ".gch"));
+                objs.pchFlag = InternString(clang
+                    ? FormatString(tempMem.arena, "-include-pch %s", objs.pch.Str().CStr())
+                    : FormatString(tempMem.arena, "-Winvalid-pch -include %s", pchBase.CStr()));
+                objs.buildsPch = true;
+                pchOwners.push_back(t);
+            }
+        }
+
+        // Objects optimized with a profile are private to their target
+        bool pgo = !target.pgoTrainingCommand.Empty();
+        if (pgo && target.type != TargetType::Executable) {
+            Fatal("Target \"%s\" sets pgoTrainingCommand but isn't an executable\n", target.name.CStr());
+        }
+        String objectDir = pgo ? PgoObjectDir(tempMem.arena, target, "pgo-use") : "$builddir";
+
+        std::vector<bool> heavyInput;
+        if (!target.heavyInputs.empty()) {
+            heavyInput.assign(target.inputs.size(), false);
+            for (const auto& heavy : target.heavyInputs) {
+                auto input = std::find(target.inputs.begin(), target.inputs.end(), heavy);
+                if (input == target.inputs.end()) {
+                    Fatal("Heavy input %s isn't an input of target \"%s\"\n", heavy.CStr(), target.name.CStr());
+                }
+                heavyInput[input - target.inputs.begin()] = true;
+            }
+        }
+
+        if (target.unityBatchSize > 1 && target.inputs.size() > 1) {
+            // Unity objects are private to their target so never shared
+            objs.unityBatches = PlanUnityBatches(target);
+            for (size_t b = 0; b < objs.unityBatches.size(); b++) {
+                String object = pgo
+                    ? FormatString(tempMem.arena, "%s/unity_%zu.o", objectDir.CStr(), b)
+                    : FormatString(tempMem.arena, "$builddir/%s.o", UnityName(tempMem.arena, target, b).CStr());
+                objs.objects.emplace_back(InternString(object));
+                objs.buildsObject.push_back(true);
+                if (!heavyInput.empty()) {
+                    const auto& batch = objs.unityBatches[b];
+                    objs.heavy.push_back(std::any_of(batch.begin(), batch.end(),
+                                                     [&](size_t i) { return heavyInput[i]; }));
+                }
+            }
+            continue;
+        }
+
+        objs.objects.reserve(target.inputs.size());
+        objs.buildsObject.reserve(target.inputs.size());
+        objs.heavy = heavyInput;
+        for (const auto& i : target.inputs) {
+            InternedString object = InternString(
+                FormatString(tempMem.arena, "%s/%.*s.o", objectDir.CStr(), int(ExtPos(i)), i.CStr()));
+            if (pgo) {
+                objs.objects.emplace_back(object);
+                objs.buildsObject.push_back(true);
+                continue;
+            }
+            auto& slot = objectOwners.Find(object);
+            bool firstBuild = slot.first == InternedString();
+            if (firstBuild) {
+                slot = {object, owners.size()};
+                owners.emplace_back(t, &i);
+            } else {
+                const auto& owner = owners[slot.second];
+                const TargetObjects& ownerObjs = plan[owner.first];
+                if (*owner.second != i) {
+                    Fatal("%s and %s both compile to %s, rename one of them\n",
+                          owner.second->CStr(), i.CStr(), object.Str().CStr());
+                }
+                if (ownerObjs.cflags != objs.cflags || ownerObjs.pchFlag != objs.pchFlag) {
+                    Fatal("%s is built by targets \"%s\" and \"%s\" with different compile flags\n",
+                          i.CStr(), targets[owner.first].name.CStr(), target.name.CStr());
+                }
+            }
+            objs.objects.emplace_back(object);
+            objs.buildsObject.push_back(firstBuild);
+        }
+    }
+    return plan;
+}
+
+/*
+ * Writes the unity files planned for each target into $builddir,
+ * leaving files whose list of inputs hasn't changed untouched so Ninja
+ * doesn't recompile them.
+ */
+void WriteUnityFiles(const std::vector<Target>& targets, const std::vector<TargetObjects>& plan,
+                     const String& buildDir, const String& relativeRoot) {
+    for (size_t t = 0; t < targets.size(); t++) {
+        if (plan[t].unityBatches.empty()) continue;
+        auto tempMem = BeginTempStringArena();
+        const Target& target = targets[t];
+        String unityDir = FormatString(tempMem.arena, "%s/%s/%s", buildDir.CStr(), kNinjaBuildDir,
+                                       NinjaIdentifier(tempMem.arena, target.name).CStr());
+        if (!MakeDir(DirName(unityDir), true) || !MakeDir(unityDir, true)) {
+            Fatal("Failed to make directory \"%s\"\n", unityDir.CStr());
+        }
+        NinjaWriter w;
+        for (size_t b = 0; b < plan[t].unityBatches.size(); b++) {
+            w.Clear();
+            w.Append("// This file was generated by bcpp.\n");
+            for (size_t i : plan[t].unityBatches[b]) {
+                // Included relative to the unity file in $builddir/<target>/
+                w.Append(FormatString(tempMem.arena, "#include \"../../%s/%s\"\n",
+                                      relativeRoot.CStr(), target.inputs[i].CStr()));
+            }
+            String path = FormatString(tempMem.arena, "%s/%s/%s.cpp", buildDir.CStr(), kNinjaBuildDir,
+                                       UnityName(tempMem.arena, target, b).CStr());
+            if (!WriteFileIfChanged(path, w.buf, w.used)) {
+                Fatal("Failed to write %s\n", path.CStr());
+            }
+        }
+    }
+}
+
+/*
+ * Links and heavy compiles each get a Ninja pool deep enough for as many of
+ * the most memory hungry edge in it as fit in physical memory. Total rather
+ * than currently available memory keeps build.ninja the same from one
+ * generation to the next.
+ */
+size_t PhysicalMemoryMB() {
+#ifdef __linux__
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[256];
+        unsigned long long kb = 0;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "MemTotal: %llu kB", &kb) == 1) break;
+        }
+        fclose(f);
+        if (kb) {
+            return size_t(kb / 1024);
+        }
+    }
+#endif
+    return size_t(uint64_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / (1024 * 1024));
+}
+
+size_t PoolDepth(size_t memoryMB, int edgeMemoryMB) {
+    return std::max<size_t>(1, memoryMB / std::max(1, edgeMemoryMB));
+}
+
+bool IsLinked(const Target& target) {
+    return target.type == TargetType::Executable || target.type == TargetType::SharedLibrary;
+}
+
+// Declares link_pool and heavy_pool for the targets that use them. Returns
+// whether there is a link_pool. Sizes given in build.cpp win over measured
+// ones, which win over the defaults.
+bool WriteMemoryPools(NinjaWriter* ninja, const std::vector<Target>& targets,
+                      const std::vector<TargetObjects>& plan, const Compiler& comp) {
+    int linkMB = 0;
+    int heavyMB = 0;
+    for (size_t t = 0; t < targets.size(); t++) {
+        const Target& target = targets[t];
+        if (IsLinked(target)) {
+            int defaultMB = comp.lto == Flag::On ? 4096 : 1024;
+            if (plan[t].linkMemoryMB) {
+                defaultMB = plan[t].linkMemoryMB;
+            }
+            linkMB = std::max(linkMB, target.linkMemoryMB ? target.linkMemoryMB : defaultMB);
+        }
+        if (!target.heavyInputs.empty()) {
+            heavyMB = std::max(heavyMB, target.heavyInputMemoryMB ? target.heavyInputMemoryMB : 2048);
+        }
+        heavyMB = std::max(heavyMB, plan[t].heavyMemoryMB);
+    }
+    if (!linkMB && !heavyMB) {
+        return false;
+    }
+    size_t memoryMB = PhysicalMemoryMB();
+    if (linkMB) {
+        NinjaPool(ninja, "link_pool", PoolDepth(memoryMB, linkMB));
+    }
+    if (heavyMB) {
+        NinjaPool(ninja, "heavy_pool", PoolDepth(memoryMB, heavyMB));
+    }
+    NinjaNewline(ninja);
+    return linkMB != 0;
+}
+
+std::vector<NinjaVar> HeavyPoolVars(const TargetObjects& objs, size_t object) {
+    if (objs.heavy.empty() || !objs.heavy[object]) {
+        return {};
+    }
+    return {{"pool", {"heavy_pool"}}};
+}
+
+/*
+ * Edge profiles
+ *
+ * With --profile-edges every compile, link and archive runs through
+ * `buildcpp run-edge <log> <command>`, which appends the wall time, CPU time
+ * and peak RSS of the command to $builddir/edges.log. With --cache too,
+ * cache-cxx writes the records itself, only for compiles that ran the
+ * compiler, so a cache hit never replaces what the compile really costs. The
+ * next generation reads the log back to start each target's slowest compiles
+ * first, to move compiles that needed more than their share of memory into
+ * heavy_pool, and to size link_pool and heavy_pool from what edges actually
+ * used.
+ */
+
+const char* const kEdgeLogName = "edges.log";
+const uint32_t kEdgeRecordMagic = 0x62656467; // "bedg"
+
+// One run of an edge, appended with a single write so records from
+// concurrent edges never interleave
+struct EdgeRecord {
+    uint32_t magic;
+    uint32_t wallMs;
+    uint32_t cpuMs;
+    uint32_t peakRssKB;
+    // HashString of the output as Ninja spells it, relative to the build directory
+    uint64_t outputHash;
+};
+
+// The latest record for each output, sorted by outputHash
+struct EdgeProfiles {
+    std::vector<EdgeRecord> records;
+};
+
+// The file a compile, link or archive command writes: what follows -o, or
+// for ar the archive after the operation letters
+const char* EdgeOutput(int argc, const char** argv) {
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            return argv[i + 1];
+        }
+    }
+    String tool = BaseName(String(argv[0]));
+    if (argc > 2 && tool.Len() >= 2 && strcmp(tool.CStr() + tool.Len() - 2, "ar") == 0) {
+        return argv[2];
+    }
+    return nullptr;
+}
+
+uint32_t TimevalMs(const struct timeval& tv) {
+    return uint32_t(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/*
+ * Appends the record of a finished command to log. Appenders share the lock
+ * that ReadEdgeProfiles takes exclusively to compact the log, so a record is
+ * never lost to a rewrite. A log that can't be written never fails the build.
+ */
+void AppendEdgeRecord(const char* log, const char* output, double wallMs, const struct rusage& usage) {
+    EdgeRecord record;
+    record.magic = kEdgeRecordMagic;
+    record.wallMs = uint32_t(wallMs);
+    record.cpuMs = TimevalMs(usage.ru_utime) + TimevalMs(usage.ru_stime);
+#ifdef __APPLE__
+    record.peakRssKB = uint32_t(usage.ru_maxrss / 1024);
+#else
+    record.peakRssKB = uint32_t(usage.ru_maxrss);
+#endif
+    record.outputHash = HashString(String(output));
+    int fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        flock(fd, LOCK_SH);
+        ssize_t written = write(fd, &record, sizeof(record));
+        (void)written;
+        close(fd);
+    }
+}
+
+/*
+ * Runs the null terminated argv and, if it succeeds, appends its record to
+ * log. Returns its exit status. wait4 reports the peak RSS of the largest
+ * process the command waited for, so the compiler proper behind a driver is
+ * counted.
+ */
+int RunRecorded(const char* log, const char** argv) {
+    double start = NowMs();
+    pid_t pid = fork();
+    if (pid < 0) {
+        Fatal("Failed to fork\n");
+    }
+    if (pid == 0) {
+        execvp(argv[0], const_cast<char* const*>(argv));
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        Fatal("Failed to wait for %s\n", argv[0]);
+    }
+
+    int argc = 0;
+    while (argv[argc]) argc++;
+    const char* output = EdgeOutput(argc, argv);
+    if (output && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        AppendEdgeRecord(log, output, NowMs() - start, usage);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// `buildcpp run-edge <log> <command>...` runs command through RunRecorded
+int RunEdge(int argc, const char** argv) {
+    if (argc < 2) {
+        Fatal("usage: buildcpp run-edge <log> <command> <args>...\n");
+    }
+    // argv is null terminated as it came from main
+    return RunRecorded(argv[0], argv + 1);
+}
+
+/*
+ * Reads buildDir/$builddir/edges.log, keeping the latest record for each
+ * output. A log grown well past one record per output is rewritten in place
+ * with just those. The exclusive lock, held from the read to the rewrite,
+ * keeps records appended by edges still running from being dropped.
+ */
+EdgeProfiles ReadEdgeProfiles(const String& buildDir) {
+    EdgeProfiles profiles;
+    String path = FormatString("%s/%s/%s", buildDir.CStr(), kNinjaBuildDir, kEdgeLogName);
+    int fd = open(path.CStr(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return profiles;
+    }
+    flock(fd, LOCK_EX);
+    MappedFile file;
+    if (!MapFile(path, &file)) {
+        close(fd);
+        return profiles;
+    }
+    size_t numRecords = file.len / sizeof(EdgeRecord);
+    profiles.records.reserve(numRecords);
+    // Newest first so the unique pass below keeps the latest run
+    for (size_t i = numRecords; i-- > 0;) {
+        EdgeRecord record;
+        memcpy(&record, file.data + i * sizeof(EdgeRecord), sizeof(record));
+        if (record.magic == kEdgeRecordMagic) {
+            profiles.records.push_back(record);
+        }
+    }
+    UnmapFile(&file);
+
+    auto& records = profiles.records;
+    std::stable_sort(records.begin(), records.end(), [](const EdgeRecord& a, const EdgeRecord& b) {
+        return a.outputHash < b.outputHash;
+    });
+    records.erase(std::unique(records.begin(), records.end(), [](const EdgeRecord& a, const EdgeRecord& b) {
+        return a.outputHash == b.outputHash;
+    }), records.end());
+    if (numRecords > 1024 && numRecords > 4 * records.size()) {
+        size_t len = records.size() * sizeof(EdgeRecord);
+        if (pwrite(fd, records.data(), len, 0) == ssize_t(len)) {
+            int truncated = ftruncate(fd, len);
+            (void)truncated;
+        }
+    }
+    close(fd);
+    return profiles;
+}
+
+// A path as written in build.ninja the way Ninja spells it once $builddir
+// is expanded, which is how edges are named in logs
+String ExpandBuildDir(StringArena* arena, const String& ninjaPath) {
+    if (strncmp(ninjaPath.CStr(), "$builddir/", 10) != 0) {
+        return ninjaPath;
+    }
+    return FormatString(arena, "%s/%s", kNinjaBuildDir, ninjaPath.CStr() + 10);
+}
+
+uint64_t HashNinjaPath(const String& ninjaPath) {
+    auto tempMem = BeginTempStringArena();
+    return HashString(ExpandBuildDir(tempMem.arena, ninjaPath));
+}
+
+// The record for a path as written in build.ninja, or null
+const EdgeRecord* FindEdgeRecord(const EdgeProfiles& profiles, const String& ninjaPath) {
+    if (profiles.records.empty()) {
+        return nullptr;
+    }
+    uint64_t hash = HashNinjaPath(ninjaPath);
+    auto record = std::lower_bound(profiles.records.begin(), profiles.records.end(), hash,
+                                   [](const EdgeRecord& r, uint64_t h) { return r.outputHash < h; });
+    return record != profiles.records.end() && record->outputHash == hash ? &*record : nullptr;
+}
+
+int RecordMemoryMB(const EdgeRecord& record) {
+    return int((record.peakRssKB + 1023) / 1024);
+}
+
+/*
+ * Orders each target's compiles slowest first and marks compiles heavy that
+ * needed more memory than physical memory divided among one job per core,
+ * the most a full-width build can afford for every edge.
+ */
+void ApplyEdgeProfiles(const std::vector<Target>& targets, const EdgeProfiles& profiles,
+                       std::vector<TargetObjects>* plan) {
+    if (profiles.records.empty()) {
+        return;
+    }
+    size_t numJobs = std::max(1u, std::thread::hardware_concurrency());
+    int heavyThresholdMB = int(PhysicalMemoryMB() / numJobs);
+    for (size_t t = 0; t < targets.size(); t++) {
+        auto tempMem = BeginTempStringArena();
+        TargetObjects& objs = (*plan)[t];
+        std::vector<uint32_t> wallMs(objs.objects.size());
+        bool anyRecord = false;
+        for (size_t i = 0; i < objs.objects.size(); i++) {
+            const EdgeRecord* record = objs.buildsObject[i] ? FindEdgeRecord(profiles, objs.objects[i].Str()) : nullptr;
+            if (!record) continue;
+            anyRecord = true;
+            wallMs[i] = record->wallMs;
+            int memoryMB = RecordMemoryMB(*record);
+            if (memoryMB > heavyThresholdMB) {
+                objs.heavy.resize(objs.objects.size());
+                objs.heavy[i] = true;
+                objs.heavyMemoryMB = std::max(objs.heavyMemoryMB, memoryMB);
+            }
+        }
+        if (anyRecord) {
+            objs.compileOrder.resize(objs.objects.size());
+            for (size_t i = 0; i < objs.compileOrder.size(); i++) {
+                objs.compileOrder[i] = i;
+            }
+            std::stable_sort(objs.compileOrder.begin(), objs.compileOrder.end(),
+                             [&](size_t a, size_t b) { return wallMs[a] > wallMs[b]; });
+        }
+        if (IsLinked(targets[t])) {
+            const EdgeRecord* link = FindEdgeRecord(profiles, GetTargetOutput(tempMem.arena, targets[t]).path);
+            if (link) {
+                objs.linkMemoryMB = RecordMemoryMB(*link);
+            }
+        }
+    }
+}
+
+// Where the profile for a PGO target is collected
+String PgoProfileDir(StringArena* arena, const Target& target) {
+    return FormatString(arena, "$builddir/%s/pgo", NinjaIdentifier(arena, target.name).CStr());
+}
+
+// The merged profile (Clang) or a stamp for the trained .gcda files (GCC)
+String PgoProfile(StringArena* arena, const Target& target, bool clang) {
+    return ConcatStrings(arena, PgoProfileDir(arena, target), clang ? "/merged.profdata" : "/trained.stamp");
+}
+
+String PgoUseFlags(StringArena* arena, const Target& target, const String& profile, bool clang) {
+    if (clang) {
+        return FormatString(arena, "-fprofile-instr-use=%s", profile.CStr());
+    }
+    // Profiles are named after the object path relative to -fprofile-prefix-path,
+    // which GCC wants absolute
+    return FormatString(arena, "-fprofile-use=$$PWD/%s -fprofile-prefix-path=$$PWD/%s -Wno-missing-profile",
+                        PgoProfileDir(arena, target).CStr(),
+                        PgoObjectDir(arena, target, "pgo-use").CStr());
+}
+
+/*
+ * Writes the first phase of a PGO build: the target's objects compiled and
+ * linked with instrumentation under $builddir/<target>/pgo-gen, and an edge
+ * running pgoTrainingCommand against the result. Clang's raw profiles are
+ * merged with llvm-profdata, GCC writes its .gcda files straight into the
+ * profile directory. Returns the file the optimized objects depend on.
+ */
+String WriteTargetPgoTraining(NinjaWriter* ninja, StringArena* arena, const Target& target,
+                              const TargetObjects& objs, const std::vector<String>& objectSources,
+                              const String& cflags, const std::vector<String>& implicitInputs,
+                              const std::vector<String>& targetLdFlags, const TargetOutput& out,
+                              bool clang) {
+    String targetId = NinjaIdentifier(arena, target.name);
+    String profileDir = PgoProfileDir(arena, target);
+    String genDir = PgoObjectDir(arena, target, "pgo-gen");
+    String useDir = PgoObjectDir(arena, target, "pgo-use");
+
+    String genFlags = clang
+        ? FormatString(arena, "-fprofile-instr-generate=$$PWD/%s/%%p.profraw", profileDir.CStr())
+        : FormatString(arena, "-fprofile-generate=$$PWD/%s -fprofile-prefix-path=$$PWD/%s -fprofile-update=atomic",
+                       profileDir.CStr(), genDir.CStr());
+    String genRule = FormatString(arena, "cxx_%s_pgo_gen", targetId.CStr());
+    NinjaCxxRule(ninja, arena, genRule, FormatString(arena, "%s %s", cflags.CStr(), genFlags.CStr()));
+
+    std::vector<String> genObjects;
+    genObjects.reserve(objs.objects.size());
+    for (size_t i = 0; i < objs.objects.size(); i++) {
+        genObjects.emplace_back(FormatString(arena, "%s%s", genDir.CStr(),
+                                             objs.objects[i].Str().CStr() + useDir.Len()));
+        NinjaBuild(ninja, genObjects.back(), genRule, {objectSources[i]},
+                   HeavyPoolVars(objs, i), implicitInputs, objs.generatedHeaders);
+    }
+
+    std::vector<String> genLdFlags = targetLdFlags;
+    genLdFlags.emplace_back(clang ? "-fprofile-instr-generate" : "-fprofile-generate");
+    String genExe = FormatString(arena, "%s/%s", genDir.CStr(), out.path.CStr());
+    std::vector<NinjaVar> genLinkVars = {{"ldflags", genLdFlags}};
+    if (!objs.libs.empty()) {
+        genLinkVars.push_back(NinjaVar{"libs", objs.libs});
+    }
+    NinjaBuild(ninja, genExe, out.rule, genObjects, genLinkVars, objs.libs);
+
+    // Training starts from an empty profile directory every time
+    String profile = PgoProfile(arena, target, clang);
+    String trainCommand = FormatString(arena, "rm -rf %s && mkdir -p %s && %s && %s",
+        profileDir.CStr(), profileDir.CStr(), target.pgoTrainingCommand.CStr(),
+        clang ? "$profdata merge -o $out " : "touch $out");
+    if (clang) {
+        trainCommand = FormatString(arena, "%s%s/*.profraw", trainCommand.CStr(), profileDir.CStr());
+    }
+    String trainRule = FormatString(arena, "pgo_train_%s", targetId.CStr());
+    NinjaRule(ninja, trainRule, trainCommand, {{"description", {"PGO TRAIN $in"}}});
+    NinjaBuild(ninja, profile, trainRule, {genExe});
+    return profile;
+}
+
+// Ninja evaluates variables on a build statement before $in and $out exist,
+// so a command passed that way gets them substituted here, spelled either
+// $in or ${in}. A value in build.ninja can't hold a newline, so $in_newline,
+// meant for response files, separates the inputs with spaces like $in. The
+// result is sized in a first pass and then written straight into arena.
+String ExpandInOut(StringArena* arena, const String& command, const std::vector<String>& inputs,
+                   const String& output) {
+    auto isIdent = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '_' || c == '-';
+    };
+    char* buf = nullptr;
+    size_t len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t used = 0;
+        auto append = [&](const char* str, size_t n) {
+            if (buf) memcpy(buf + used, str, n);
+            used += n;
+        };
+        auto appendInputs = [&]() {
+            for (size_t i = 0; i < inputs.size(); i++) {
+                if (i) append(" ", 1);
+                append(inputs[i].CStr(), inputs[i].Len());
+            }
+        };
+        const char* p = command.CStr();
+        const char* end = p + command.Len();
+        while (p < end) {
+            const char* run = p;
+            while (p < end && *p != '$') p++;
+            append(run, p - run);
+            if (p == end) break;
+            if (p + 1 < end && p[1] == '$') {
+                append(p, 2);
+                p += 2;
+                continue;
+            }
+            // The variable's name and where its reference ends
+            const char* name = p + 1;
+            const char* nameEnd = name;
+            const char* next = name;
+            if (name < end && *name == '{') {
+                name++;
+                nameEnd = static_cast<const char*>(memchr(name, '}', end - name));
+                next = nameEnd ? nameEnd + 1 : nullptr;
+            } else {
+                while (nameEnd < end && isIdent(*nameEnd)) nameEnd++;
+                next = nameEnd;
+            }
+            String varName = next ? String(name, nameEnd - name) : String();
+            if (varName == "in" || varName == "in_newline") {
+                appendInputs();
+            } else if (varName == "out") {
+                append(output.CStr(), output.Len());
+            } else {
+                append(p++, 1);
+                continue;
+            }
+            p = next;
+        }
+        if (pass == 0) {
+            if (used == 0) {
+                return String();
+            }
+            len = used;
+            buf = AllocString(arena, len + 1);
+        }
+    }
+    buf[len] = '\0';
+    return String(buf, len);
+}
+
+// Writes everything Ninja needs to build and install one target. All strings
+// come from arena so targets can be written concurrently.
+void WriteTargetNinja(NinjaWriter* ninja, StringArena* arena, const Target& target,
+                      const TargetObjects& objs, bool clang) {
+    if (!target.generatedHeaders.empty()) {
+        String genRule = ConcatStrings(arena, "gen_", NinjaIdentifier(arena, target.name));
+        NinjaRule(ninja, genRule, "$command", {{"description", {"GEN $out"}}, {"restat", {"1"}}});
+        std::vector<String> headers;
+        for (const auto& header : target.generatedHeaders) {
+            std::vector<String> inputs;
+            for (const auto& input : header.inputs) {
+                inputs.emplace_back(ConcatStrings(arena, "$root/", input));
+            }
+            headers.emplace_back(ConcatStrings(arena, "$builddir/", header.output));
+            NinjaBuild(ninja, headers.back(), genRule, inputs,
+                       {{"command", {ExpandInOut(arena, header.command, inputs, headers.back())}}});
+        }
+        NinjaBuild(ninja, GeneratedHeadersPhony(arena, target), "phony", headers);
+    }
+
+    // Targets with their own compile flags get their own cxx rule so the
+    // flags are written once rather than under every object file
+    String compileRule = "cxx";
+    String cflags = "$cflags";
+    std::vector<String> implicitInputs;
+    if (!objs.cflags.empty() || objs.pch != InternedString() || !target.pgoTrainingCommand.Empty()) {
+        std::vector<String> targetCFlags;
+        targetCFlags.reserve(objs.cflags.size() + 1);
+        targetCFlags.emplace_back("$cflags");
+        for (const auto& flag : objs.cflags) {
+            targetCFlags.emplace_back(flag.Str());
+        }
+        String targetId = NinjaIdentifier(arena, target.name);
+        String cflagsVar = ConcatStrings(arena, "cflags_", targetId);
+        compileRule = ConcatStrings(arena, "cxx_", targetId);
+        NinjaVariable(ninja, cflagsVar, targetCFlags);
+        cflags = ConcatStrings(arena, "$", cflagsVar);
+        if (objs.pch != InternedString()) {
+            if (objs.buildsPch) {
+                String pchRule = ConcatStrings(arena, "pch_", targetId);
+                NinjaPchRule(ninja, arena, pchRule, cflags);
+                NinjaBuild(ninja, objs.pch.Str(), pchRule,
+                           {ConcatStrings(arena, "$root/", target.precompiledHeader)},
+                           {}, {}, objs.generatedHeaders);
+            }
+            cflags = FormatString(arena, "%s %s", cflags.CStr(), objs.pchFlag.Str().CStr());
+            implicitInputs.emplace_back(objs.pch.Str());
+        }
+    }
+
+    std::vector<String> objectSources;
+    objectSources.reserve(objs.objects.size());
+    for (size_t i = 0; i < objs.objects.size(); i++) {
+        objectSources.emplace_back(objs.unityBatches.empty()
+            ? ConcatStrings(arena, "$root/", target.inputs[i])
+            : FormatString(arena, "$builddir/%s.cpp", UnityName(arena, target, i).CStr()));
+    }
+
+    std::vector<String> targetLdFlags;
+    targetLdFlags.reserve(target.linkFlags.size() + target.linkDirectories.size() + 2);
+    targetLdFlags.emplace_back("$ldflags");
+    for (const auto& dir : target.linkDirectories) {
+        AppendLinkDirectory(arena, targetLdFlags, dir);
+    }
+    for (const auto& linkFlag : target.linkFlags) {
+        AppendLinkFlag(arena, targetLdFlags, linkFlag); 
+    }
+    TargetOutput out = GetTargetOutput(arena, target);
+    if (target.type == TargetType::SharedLibrary) {
+        targetLdFlags.emplace_back(ConcatStrings(arena, kSharedLinkFlags, BaseName(out.path)));
+    }
+    if (objs.linksSharedLibs) {
+        targetLdFlags.emplace_back(kSharedLibRPath);
+    }
+
+    if (!target.pgoTrainingCommand.Empty()) {
+        String profile = WriteTargetPgoTraining(ninja, arena, target, objs, objectSources, cflags,
+                                                implicitInputs, targetLdFlags, out, clang);
+        cflags = FormatString(arena, "%s %s", cflags.CStr(), PgoUseFlags(arena, target, profile, clang).CStr());
+        implicitInputs.emplace_back(profile);
+    }
+    if (compileRule != "cxx") {
+        NinjaCxxRule(ninja, arena, compileRule, cflags);
+    }
+
+    std::vector<String> objectFiles;
+    objectFiles.reserve(objs.objects.size());
+    for (size_t i = 0; i < objs.objects.size(); i++) {
+        objectFiles.emplace_back(objs.objects[i].Str());
+    }
+    // Ninja before 1.12 starts ready edges in the order they appear, so the
+    // link keeps declaration order while the compiles go slowest first. 1.12
+    // and later schedule by critical path from .ninja_log and ignore this.
+    for (size_t n = 0; n < objs.objects.size(); n++) {
+        size_t i = objs.compileOrder.empty() ? n : objs.compileOrder[n];
+        if (objs.buildsObject[i]) {
+            NinjaBuild(ninja, objectFiles[i], compileRule, {objectSources[i]},
+                       HeavyPoolVars(objs, i), implicitInputs, objs.generatedHeaders);
+        }
+    }
+
+    std::vector<NinjaVar> extraLinkVars;
+    if (targetLdFlags.size() > 1) {
+        extraLinkVars.push_back(NinjaVar{"ldflags", targetLdFlags});
+    }
+    if (!objs.libs.empty()) {
+        extraLinkVars.push_back(NinjaVar{"libs", objs.libs});
+    }
+    // Libraries are only needed to link, so they build alongside this
+    // target's objects
+    NinjaBuild(ninja, out.path, out.rule, objectFiles, extraLinkVars, objs.libs);
+
+    if (target.isDefault) {
+        NinjaDefault(ninja, out.path);
+    }
+
+    if (target.install) {
+        String installOut = FormatString(arena, "$prefix/%s/%s", out.installDir.CStr(), out.path.CStr());
+        NinjaBuild(ninja, installOut, "cp", {out.path});
+    }
+}
+
+// What the Ninja variables used in compile commands expand to
+struct CompdbVars {
+    String root;     // $root
+    String builddir; // $builddir
+    String pwd;      // $$PWD, the absolute build directory
+};
+
+// Appends str with its Ninja variables expanded, escaped for a JSON string
+void AppendCompdbString(NinjaWriter* w, const String& str, const CompdbVars& vars) {
+    auto isIdent = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '_' || c == '-';
+    };
+    const char* p = str.CStr();
+    const char* end = p + str.Len();
+    while (p < end) {
+        if (*p == '$' && p + 1 < end) {
+            if (p[1] == '$') {
+                if (end - p >= 5 && memcmp(p + 2, "PWD", 3) == 0 && (p + 5 == end || !isIdent(p[5]))) {
+                    AppendCompdbString(w, vars.pwd, vars);
+                    p += 5;
+                } else {
+                    w->Append('$');
+                    p += 2;
+                }
+                continue;
+            }
+            const char* name = p + 1;
+            const char* nameEnd = name;
+            while (nameEnd < end && isIdent(*nameEnd)) nameEnd++;
+            String varName(name, nameEnd - name);
+            if (varName == "root") {
+                AppendCompdbString(w, vars.root, vars);
+                p = nameEnd;
+                continue;
+            }
+            if (varName == "builddir") {
+                AppendCompdbString(w, vars.builddir, vars);
+                p = nameEnd;
+                continue;
+            }
+        }
+        if (*p == '"' || *p == '\\') {
+            w->Append('\\');
+            w->Append(*p++);
+            continue;
+        }
+        // Control characters, like a tab in a define, only have \u escapes
+        if (uint8_t(*p) < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(*p++));
+            w->Append(escaped, 6);
+            continue;
+        }
+        // Copy up to the next character needing attention in one go
+        const char* run = p++;
+        while (p < end && *p != '$' && *p != '"' && *p != '\\' && uint8_t(*p) >= 0x20) p++;
+        w->Append(run, p - run);
+    }
+}
+
+/*
+ * Writes compile_commands.json for every object straight from the plan, so
+ * tools like clangd don't need "ninja -t compdb" to reparse the manifest.
+ * Inputs of unity builds get their own entries with their target's flags.
+ */
+void WriteCompileCommands(const String& path, const std::vector<Target>& targets,
+                          const std::vector<TargetObjects>& plan, const String& cxx,
+                          const std::vector<String>& cflags, const CompdbVars& vars, bool clang) {
+    NinjaWriter w;
+    NinjaWriter command;
+    NinjaWriter directory;
+    NinjaWriter scratch;
+    AppendCompdbString(&directory, vars.pwd, vars);
+
+    size_t numInputs = 0;
+    for (const auto& target : targets) {
+        numInputs += target.inputs.size();
+    }
+    // Entries are a few hundred bytes, mostly the command
+    w.Reserve(numInputs * 512);
+
+    bool first = true;
+    w.Append("[", 1);
+    for (size_t t = 0; t < targets.size(); t++) {
+        auto tempMem = BeginTempStringArena();
+        const Target& target = targets[t];
+        const TargetObjects& objs = plan[t];
+
+        command.Clear();
+        AppendCompdbString(&command, cxx, vars);
+        for (const auto& flag : cflags) {
+            command.Append(' ');
+            AppendCompdbString(&command, flag, vars);
+        }
+        for (const auto& flag : objs.cflags) {
+            command.Append(' ');
+            AppendCompdbString(&command, flag.Str(), vars);
+        }
+        if (objs.pch != InternedString()) {
+            command.Append(' ');
+            AppendCompdbString(&command, objs.pchFlag.Str(), vars);
+        }
+        if (!target.pgoTrainingCommand.Empty()) {
+            command.Append(' ');
+            AppendCompdbString(&command, PgoUseFlags(tempMem.arena, target,
+                               PgoProfile(tempMem.arena, target, clang), clang), vars);
+        }
+
+        // The object each input is compiled into
+        std::vector<size_t> inputObjects(target.inputs.size());
+        for (size_t i = 0; i < inputObjects.size(); i++) {
+            inputObjects[i] = i;
+        }
+        for (size_t b = 0; b < objs.unityBatches.size(); b++) {
+            for (size_t i : objs.unityBatches[b]) {
+                inputObjects[i] = b;
+            }
+        }
+
+        for (size_t i = 0; i < target.inputs.size(); i++) {
+            size_t object = inputObjects[i];
+            if (!objs.buildsObject[object]) {
+                continue;
+            }
+            // Expand the source and object paths once for both of their uses
+            scratch.Clear();
+            AppendCompdbString(&scratch, vars.root, vars);
+            scratch.Append('/');
+            AppendCompdbString(&scratch, target.inputs[i], vars);
+            size_t sourceLen = scratch.used;
+            AppendCompdbString(&scratch, objs.objects[object].Str(), vars);
+            const char* source = scratch.buf;
+            const char* output = scratch.buf + sourceLen;
+            size_t outputLen = scratch.used - sourceLen;
+
+            w.Append(first ? "\n  {\n    \"directory\": \"" : ",\n  {\n    \"directory\": \"");
+            first = false;
+            w.Append(directory.buf, directory.used);
+            w.Append("\",\n    \"command\": \"");
+            w.Append(command.buf, command.used);
+            w.Append(" -c ");
+            w.Append(source, sourceLen);
+            w.Append(" -o ");
+            w.Append(output, outputLen);
+            w.Append("\",\n    \"file\": \"");
+            w.Append(source, sourceLen);
+            w.Append("\",\n    \"output\": \"");
+            w.Append(output, outputLen);
+            w.Append("\"\n  }");
+        }
+    }
+    w.Append("\n]\n");
+    if (!WriteFileIfChanged(path, w.buf, w.used)) {
+        Fatal("Failed to write %s\n", path.CStr());
+    }
+}
+
+/*
+ * Writes each target to its own buildDir/targets/<target>.ninja, which ninja
+ * includes with subninja. Targets are written by a pool of worker threads,
+ * each with its own temp arena and NinjaWriter, and files whose contents
+ * didn't change are left untouched.
+ */
+void WriteTargetNinjaFiles(NinjaWriter* ninja, const std::vector<Target>& targets,
+                           const std::vector<TargetObjects>& plan, const String& buildDir, bool clang) {
+    String targetsDir = ConcatStrings(buildDir, "/targets");
+    if (!MakeDir(targetsDir, true)) {
+        Fatal("Failed to make directory \"%s\"\n", targetsDir.CStr());
+    }
+
+    std::vector<String> targetFiles;
+    targetFiles.reserve(targets.size());
+    for (const auto& target : targets) {
+        auto tempMem = BeginTempStringArena();
+        targetFiles.emplace_back(FormatString("targets/%s.ninja",
+                                              NinjaIdentifier(tempMem.arena, target.name).CStr()));
+        NinjaSubninja(ninja, targetFiles.back());
+    }
+    NinjaNewline(ninja);
+
+    std::atomic<size_t> nextTarget(0);
+    std::atomic<size_t> numWritten(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        NinjaWriter w;
+        for (size_t i = nextTarget++; i < targets.size(); i = nextTarget++) {
+            auto tempMem = BeginTempStringArena();
+            w.Clear();
+            WriteTargetNinja(&w, tempMem.arena, targets[i], plan[i], clang);
+            String path = FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), targetFiles[i].CStr());
+            bool changed = false;
+            if (!WriteFileIfChanged(path, w.buf, w.used, &changed)) {
+                failed = true;
+            }
+            numWritten += changed;
+        }
+    };
+
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, targets.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (failed) {
+        Fatal("Failed to write target ninja files to %s\n", targetsDir.CStr());
+    }
+
+    // Delete the files of targets that were renamed or removed. Ninja never
+    // reads them again, but they would otherwise pile up in buildDir.
+    std::vector<const char*> listed;
+    listed.reserve(targetFiles.size());
+    for (const auto& file : targetFiles) {
+        listed.push_back(file.CStr() + strlen("targets/"));
+    }
+    auto less = [](const char* a, const char* b) { return strcmp(a, b) < 0; };
+    std::sort(listed.begin(), listed.end(), less);
+    size_t numDeleted = 0;
+    if (DIR* dir = opendir(targetsDir.CStr())) {
+        while (dirent* ent = readdir(dir)) {
+            size_t len = strlen(ent->d_name);
+            if (len <= 6 || strcmp(ent->d_name + len - 6, ".ninja") != 0 ||
+                std::binary_search(listed.begin(), listed.end(), ent->d_name, less)) {
+                continue;
+            }
+            auto tempMem = BeginTempStringArena();
+            String path = FormatString(tempMem.arena, "%s/%s", targetsDir.CStr(), ent->d_name);
+            numDeleted += unlink(path.CStr()) == 0;
+        }
+        closedir(dir);
+    }
+    printf("Wrote %zu of %zu target ninja files", numWritten.load(), targets.size());
+    if (numDeleted) {
+        printf(", deleted %zu stale ones", numDeleted);
+    }
+    printf("\n");
+}
+
+void Usage() {
+    Fatal(
+R"(usage: buildcpp [options] [builddir]
+       buildcpp cache-cxx [--edge-log <log>] <compiler> <args>...
+       buildcpp cache-cxx --stats | --zero-stats
+       buildcpp run-edge <log> <command> <args>...
+       buildcpp report [-C DIR] [-n N] <builddir>
+
+options:
 
   -C DIR             change to DIR before doing anything else 
   --prefix PREFIX    installation prefix
+  -g                 compile build.cpp with debug info
+  --split            write each target to its own ninja file, in parallel
+  --no-compdb        don't write compile_commands.json
+  --cache            compile through buildcpp cache-cxx, a compiler cache kept
+                     in $BCPP_CACHE_DIR (default ~/.cache/buildcpp) and limited
+                     to $BCPP_CACHE_SIZE MB (default 5120)
+  --profile-edges    run compiles, links and archives through buildcpp run-edge,
+                     logging their time and memory for the next generation to
+                     order compiles and size pools by
+  --daemon           stay running, regenerating whenever build.cpp or its
+                     headers change and answering later buildcpp calls
+  --watch            regenerate in the foreground whenever build.cpp or its
+                     headers change, reporting where the time went
+  --verify           build copies of the project in two directories and check
+                     that every output is identical
 )");
 }
 
-bool IsArg(const char* arg, const char* name, const char* altName = nullptr) {
-    return strcmp(arg, name) == 0 || (altName && strcmp(arg, altName) == 0);
+bool IsArg(const char* arg, const char* name, const char* altName = nullptr) {
+    return strcmp(arg, name) == 0 || (altName && strcmp(arg, altName) == 0);
+}
+
+String ConsumeOneArg(int* i, int argc, const char** argv) {
+    if (*i + 1 == argc || *argv[*i + 1] == '-') {
+        Fatal("Expected one value after %s\n", argv[*i]);
+    }
+    return NewString(argv[++(*i)]);
+}
+
+// Options that change what generation produces, as parsed from the command line
+struct ConfigureOptions {
+    String buildDir;
+    String installPrefix = "/usr/local";
+    bool debugBuildLib = false;
+    bool splitTargets = false;
+    bool writeCompdb = true;
+    bool compilerCache = false;
+    bool profileEdges = false;
+    String exePath;
+    // The options above as arguments for build.ninja to regenerate itself with
+    String bcppCommandLine;
+};
+
+// How long each step of a generation took
+struct ConfigureResult {
+    double compileMs = 0;
+    double loadMs = 0;
+    double generateMs = 0;
+    double writeMs = 0;
+};
+
+// Compiles build.cpp in the current directory into buildDir/build.so, loads
+// it and returns the Project it generates
+Project LoadProject(const ConfigureOptions& opts, const String& relativeRoot, ConfigureResult* result) {
+    String cxx = GetEnv("CXX", "c++");
+
+    String buildLib = ConcatStrings(opts.buildDir, "/build.so");
+    double compileStart = NowMs();
+    CompileBuildLib(opts.buildDir, relativeRoot, cxx, opts.exePath, opts.debugBuildLib);
+
+    // Resolve everything up front so a symbol missing from the executable
+    // fails here rather than partway through generation
+    double loadStart = NowMs();
+    result->compileMs = loadStart - compileStart;
+    void* buildHandle = dlopen(buildLib.CStr(), RTLD_NOW);
+    if (!buildHandle) {
+        Fatal("Failed to load \"%s\": %s\n", buildLib.CStr(), dlerror());
+    }
+    auto bcppEntry = static_cast<BuildCppEntry*>(dlsym(buildHandle, "buildCppEntry"));
+    if (!bcppEntry) {
+        Fatal("Failed to find symbol \"bcppEntry\" in %s\n", buildLib.CStr());
+    }
+
+    double generateStart = NowMs();
+    result->loadMs = generateStart - loadStart;
+    Toolchain toolchain;
+    Project project = bcppEntry->generate(toolchain);
+    result->generateMs = NowMs() - generateStart;
+    return project;
+}
+
+// Whether build.ninja's c++ is Clang, only asked when it changes what's written
+bool UsesClang(const Project& project, const String& ninjaCxx) {
+    bool anyPch = std::any_of(project.targets.begin(), project.targets.end(),
+                              [](const Target& t) { return !t.precompiledHeader.Empty(); });
+    bool anyPgo = std::any_of(project.targets.begin(), project.targets.end(),
+                              [](const Target& t) { return !t.pgoTrainingCommand.Empty(); });
+    return (anyPch || anyPgo || project.toolchain.compiler.lto == Flag::On) && IsClang(ninjaCxx);
+}
+
+// Compiles and runs build.cpp in the current directory to write
+// buildDir/build.ninja. build.so stays loaded until the process exits.
+void Configure(const ConfigureOptions& opts, ConfigureResult* result) {
+    String root = GetCwd();
+
+    // Build a relative path from buildDir back to root
+    String relativeRoot = RelativePath(root, opts.buildDir);
+    String bcppCommandLine = FormatString("%s -C %s", opts.bcppCommandLine.CStr(), "$root");
+
+    Project project = LoadProject(opts, relativeRoot, result);
+    CheckTargetIdentifiers(project.targets);
+    const Compiler& comp = project.toolchain.compiler;
+    double writeStart = NowMs();
+    double generateStart = writeStart - result->generateMs;
+
+    String ninjaCxx = "c++";
+    bool clang = UsesClang(project, ninjaCxx);
+    bool anyPgo = std::any_of(project.targets.begin(), project.targets.end(),
+                              [](const Target& t) { return !t.pgoTrainingCommand.Empty(); });
+
+    String ninjaFile = ConcatStrings(opts.buildDir, "/build.ninja");
+    NinjaWriter ninja;
+    NinjaComment(&ninja, "This file was generated by bcpp.");
+    NinjaNewline(&ninja);
+    // Ninja globals
+    NinjaVariable(&ninja, "ninja_required_version", "1.3");
+
+    NinjaVariable(&ninja, "root", relativeRoot);
+    NinjaVariable(&ninja, "builddir", kNinjaBuildDir);
+    // Command line and args
+    NinjaVariable(&ninja, "prefix", opts.installPrefix);
+    NinjaVariable(&ninja, "bcppexe", opts.exePath);
+    NinjaVariable(&ninja, "bcppcommandline", bcppCommandLine);
+
+    // Compiler and Linker 
+    String runEdge = opts.profileEdges ? FormatString("$bcppexe run-edge $builddir/%s ", kEdgeLogName) : "";
+    if (opts.compilerCache && opts.profileEdges) {
+        // cache-cxx records misses itself, so hits don't replace the real cost
+        NinjaVariable(&ninja, "cxx", FormatString("$bcppexe cache-cxx --edge-log $builddir/%s %s",
+                                                  kEdgeLogName, ninjaCxx.CStr()));
+    } else if (opts.compilerCache) {
+        NinjaVariable(&ninja, "cxx", FormatString("$bcppexe cache-cxx %s", ninjaCxx.CStr()));
+    } else {
+        NinjaVariable(&ninja, "cxx", ConcatStrings(runEdge, ninjaCxx));
+    }
+    NinjaVariable(&ninja, "ar", ConcatStrings(runEdge, ArchiverFor(comp, clang)));
+    if (anyPgo && clang) {
+#ifdef __APPLE__
+        NinjaVariable(&ninja, "profdata", "xcrun llvm-profdata");
+#else
+        NinjaVariable(&ninja, "profdata", "llvm-profdata");
+#endif
+    }
+
+    // Install/System tools
+
+    // Compiler and Linker Flags and Options
+    std::vector<String> cflags;
+    std::vector<String> ldflags;
+
+    AppendStandard(cflags, comp.standard);
+    AppendBuildType(cflags, comp.buildType);
+    AppendFlag(cflags, comp.exceptions, "exceptions");
+    AppendFlag(cflags, comp.rtti, "rtti");
+    bool thinLto = comp.lto == Flag::On && comp.ltoMode == LTO::Thin;
+    AppendLTO(cflags, ldflags, comp, clang, thinLto && clang && HasLld());
+    AppendRemapPaths(cflags, comp);
+
+    cflags.reserve(cflags.size() + project.includeDirectories.size() + project.compileFlags.size());
+    for (const auto& dir : project.includeDirectories) {
+        AppendIncludeDirectory(cflags, dir);
+    }
+    for (const auto& flag : project.compileFlags) {
+        AppendCompileFlag(cflags, flag);
+    }
+
+    ldflags.reserve(ldflags.size() + project.linkDirectories.size() + project.linkFlags.size());
+    for (const auto& dir : project.linkDirectories) {
+        AppendLinkDirectory(ldflags, dir);
+    }
+    for (const auto& flag : project.linkFlags) {
+        AppendLinkFlag(ldflags, flag);
+    }
+
+    NinjaVariable(&ninja, "cflags", cflags);
+    NinjaVariable(&ninja, "ldflags", ldflags);
+    
+    NinjaNewline(&ninja);
+
+    std::vector<TargetObjects> targetObjects = PlanTargetObjects(project.targets, clang);
+    ApplyEdgeProfiles(project.targets, ReadEdgeProfiles(opts.buildDir), &targetObjects);
+    bool linkPool = WriteMemoryPools(&ninja, project.targets, targetObjects, comp);
+
+    // Compiler and Linker rules 
+    NinjaCxxRule(&ninja, &stringArena, "cxx", "$cflags");
+    NinjaNewline(&ninja);
+
+    NinjaRule(&ninja, "ar", "rm -f $out && $ar crs $out $in", {{"description", {"AR $out"}}}); 
+    NinjaNewline(&ninja);
+
+    std::vector<NinjaVar> linkVars = {{"description", {"LINK $out"}}};
+    if (linkPool) {
+        linkVars.push_back({"pool", {"link_pool"}});
+    }
+    NinjaRule(&ninja, "link", "$cxx $ldflags -o $out $in $libs", linkVars);
+    NinjaNewline(&ninja);
+
+    // Install Rules
+    NinjaRule(&ninja, "cp", "cp -pR $in $out", {{"description", {"INSTALL $out"}}});
+    NinjaNewline(&ninja);
+
+    // Targets
+    std::vector<String> allInstallTargets;
+    for (const auto& target : project.targets) {
+        if (target.install) {
+            TargetOutput out = GetTargetOutput(&stringArena, target);
+            allInstallTargets.emplace_back(
+                FormatString("$prefix/%s/%s", out.installDir.CStr(), out.path.CStr()));
+        }
+    }
+    WriteUnityFiles(project.targets, targetObjects, opts.buildDir, relativeRoot);
+    if (opts.splitTargets) {
+        WriteTargetNinjaFiles(&ninja, project.targets, targetObjects, opts.buildDir, clang);
+    } else {
+        for (size_t i = 0; i < project.targets.size(); i++) {
+            // We create a lot of temp strings per target
+            auto tempMem = BeginTempStringArena();
+            WriteTargetNinja(&ninja, tempMem.arena, project.targets[i], targetObjects[i], clang);
+            NinjaNewline(&ninja);
+        }
+    }
+
+    // Install
+    for (const auto& installHeaders : project.installHeaders) {
+        for (const auto& header : installHeaders.headers) {
+            String installName = FormatString("$prefix/include/%s/%s",
+                                    installHeaders.subdir.CStr(), BaseName(header).CStr());
+            NinjaBuild(&ninja, installName, "cp", {ConcatStrings("$root/", header)});
+            allInstallTargets.emplace_back(installName);
+        }
+    }
+    NinjaNewline(&ninja);
+    if (!allInstallTargets.empty()) {
+        NinjaBuild(&ninja, "install", "phony", allInstallTargets);
+        NinjaNewline(&ninja);
+    }
+
+    // #SoMeta
+    NinjaRule(&ninja, "buildcpp", "$bcppexe $bcppcommandline", {{"generator", {"1"}},
+             {"restat", {"1"}}, {"depfile", {"build.so.d"}}, {"deps", {"gcc"}}});
+    NinjaBuild(&ninja, "build.ninja", "buildcpp", {"$root/build.cpp"});
+
+    NinjaNewline(&ninja);
+
+    if (opts.writeCompdb) {
+        CompdbVars vars{relativeRoot, kNinjaBuildDir, RealPath(opts.buildDir)};
+        WriteCompileCommands(ConcatStrings(opts.buildDir, "/compile_commands.json"), project.targets,
+                             targetObjects, ninjaCxx, cflags, vars, clang);
+    }
+
+    bool ninjaChanged = false;
+    if (!WriteFileIfChanged(ninjaFile, ninja.buf, ninja.used, &ninjaChanged)) {
+        Fatal("Failed to write %s\n", ninjaFile.CStr());
+    }
+    result->writeMs = NowMs() - writeStart;
+
+    if (ninjaChanged) {
+        printf("Wrote %s (%.1f ms, %.1f MB peak string memory)\n", ninjaFile.CStr(),
+               NowMs() - generateStart, PeakStringMemory() / (1024.0 * 1024.0));
+    } else {
+        printf("%s is up to date (%.1f ms, %.1f MB peak string memory)\n", ninjaFile.CStr(),
+               NowMs() - generateStart, PeakStringMemory() / (1024.0 * 1024.0));
+    }
+}
+
+/*
+ * Configure daemon
+ *
+ * `buildcpp --daemon builddir` listens on builddir/bcpp.sock, watches
+ * build.cpp and every header build.so.d lists, and regenerates as soon as one
+ * of them changes. A later `buildcpp builddir` with the same options, usually
+ * run by Ninja's generator edge, finds the socket and just replays the output
+ * of the daemon's latest generation, waiting for one to finish if a change is
+ * still pending. Each generation runs in a forked child so a Fatal() in
+ * build.cpp only fails that generation.
+ */
+
+static char daemonSocketPath[sizeof(sockaddr_un::sun_path)];
+
+void RemoveDaemonSocket(int) {
+    unlink(daemonSocketPath);
+    _exit(0);
+}
+
+// Fills in the address of the daemon socket for buildDir, relative to root
+bool DaemonAddress(const String& buildDir, sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/bcpp.sock", buildDir.CStr());
+    return len > 0 && size_t(len) < sizeof(addr->sun_path);
+}
+
+int ConnectToDaemon(const String& buildDir) {
+    sockaddr_un addr;
+    if (!DaemonAddress(buildDir, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Everything a generation depends on besides the watched files. The daemon
+// only answers clients that would have generated the same thing.
+String DaemonRequest(const ConfigureOptions& opts) {
+    return FormatString("%s\n%s\n%s\n", opts.bcppCommandLine.CStr(),
+                        GetEnv("CXX", "c++").CStr(), opts.exePath.CStr());
+}
+
+bool WriteAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads until EOF
+void ReadAll(int fd, std::vector<char>* out) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+}
+
+// Asks a running daemon for the result of its latest generation. Returns
+// false when there is no daemon or it was started with different options, in
+// which case the caller generates by itself.
+bool RequestFromDaemon(const ConfigureOptions& opts, int* exitStatus) {
+    int fd = ConnectToDaemon(opts.buildDir);
+    if (fd < 0) {
+        return false;
+    }
+    String request = DaemonRequest(opts);
+    std::vector<char> reply;
+    if (WriteAll(fd, request.CStr(), request.Len())) {
+        shutdown(fd, SHUT_WR);
+        ReadAll(fd, &reply);
+    }
+    close(fd);
+
+    // The reply is the exit status on its own line followed by the output
+    auto newline = std::find(reply.begin(), reply.end(), '\n');
+    if (newline == reply.end() || reply[0] < '0' || reply[0] > '9') {
+        return false;
+    }
+    *exitStatus = atoi(reply.data());
+    fwrite(&*newline + 1, 1, reply.end() - newline - 1, stdout);
+    return true;
+}
+
+/*
+ * Watches a set of files for changes. Linux watches their directories with
+ * inotify so replacing a file, as most editors do, is noticed too. Elsewhere
+ * the files' modification times are polled.
+ */
+struct FileWatcher {
+    std::vector<String> paths;
+#ifdef __linux__
+    int fd = -1;
+    // inotify watch descriptor of each path's directory
+    std::vector<int> dirWatches;
+#else
+    std::vector<timespec> mtimes;
+#endif
+};
+
+void WatchFiles(FileWatcher* watcher, std::vector<String> paths) {
+    watcher->paths = std::move(paths);
+#ifdef __linux__
+    if (watcher->fd >= 0) {
+        close(watcher->fd);
+    }
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        Fatal("Failed to initialize inotify\n");
+    }
+    // Watching a directory twice returns the same descriptor, however the
+    // path to it is spelled
+    watcher->dirWatches.clear();
+    for (const String& path : watcher->paths) {
+        auto tempMem = BeginTempStringArena();
+        String dir = DirNameLen(path) ? Substring(tempMem.arena, path, 0, DirNameLen(path)) : String(".");
+        watcher->dirWatches.push_back(inotify_add_watch(watcher->fd, dir.CStr(),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE));
+    }
+#else
+    watcher->mtimes.clear();
+    for (const String& path : watcher->paths) {
+        watcher->mtimes.push_back(ModTime(path));
+    }
+#endif
+}
+
+// Returns true if any watched file changed since the last call
+bool WatchedFilesChanged(FileWatcher* watcher) {
+    bool changed = false;
+#ifdef __linux__
+    alignas(inotify_event) char buf[4096];
+    ssize_t n;
+    while ((n = read(watcher->fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+            const inotify_event* event = reinterpret_cast<inotify_event*>(p);
+            if (event->len == 0) {
+                continue;
+            }
+            for (size_t i = 0; i < watcher->paths.size(); i++) {
+                changed |= watcher->dirWatches[i] == event->wd &&
+                           BaseName(watcher->paths[i]) == String(event->name);
+            }
+        }
+    }
+#else
+    for (size_t i = 0; i < watcher->paths.size(); i++) {
+        timespec mtime = ModTime(watcher->paths[i]);
+        if (mtime.tv_sec != watcher->mtimes[i].tv_sec || mtime.tv_nsec != watcher->mtimes[i].tv_nsec) {
+            watcher->mtimes[i] = mtime;
+            changed = true;
+        }
+    }
+#endif
+    return changed;
+}
+
+// build.cpp and every file the last compile of build.so read, with symlinks
+// resolved so the files that actually get edited are the ones watched
+std::vector<String> BuildLibInputs(const String& buildDir) {
+    std::vector<String> paths;
+    auto addPath = [&](const String& path) {
+        char resolved[PATH_MAX];
+        paths.push_back(realpath(path.CStr(), resolved) ? NewString(resolved) : path);
+    };
+    addPath(String("build.cpp"));
+    MappedFile depfile;
+    auto tempMem = BeginTempStringArena();
+    if (MapFile(ConcatStrings(tempMem.arena, buildDir, "/build.so.d"), &depfile)) {
+        for (const String& dep : ParseDepfile(tempMem.arena, depfile.data, depfile.len)) {
+            addPath(dep.CStr()[0] == '/' ? dep : FormatString(tempMem.arena, "%s/%s", buildDir.CStr(), dep.CStr()));
+        }
+        UnmapFile(&depfile);
+    }
+    return paths;
+}
+
+// Runs Configure() in a child process whose output goes to the returned
+// pipe, followed by how long each step took if printTimes is set
+pid_t StartGeneration(const ConfigureOptions& opts, int* outputFd, bool printTimes = false) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        Fatal("Failed to create pipe\n");
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        Fatal("Failed to fork\n");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        ConfigureResult result;
+        Configure(opts, &result);
+        if (printTimes) {
+            printf("bcpp: compile %.0f ms, load %.1f ms, generate %.1f ms, write %.1f ms\n",
+                   result.compileMs, result.loadMs, result.generateMs, result.writeMs);
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    *outputFd = fds[0];
+    return pid;
+}
+
+int RunDaemon(const ConfigureOptions& opts) {
+    sockaddr_un addr;
+    if (!DaemonAddress(opts.buildDir, &addr)) {
+        Fatal("Socket path %s/bcpp.sock is too long\n", opts.buildDir.CStr());
+    }
+    int running = ConnectToDaemon(opts.buildDir);
+    if (running >= 0) {
+        Fatal("A daemon is already running for %s\n", opts.buildDir.CStr());
+    }
+    // Left behind by a daemon that didn't exit cleanly
+    unlink(addr.sun_path);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listenFd, 16) != 0) {
+        Fatal("Failed to listen on %s\n", addr.sun_path);
+    }
+    memcpy(daemonSocketPath, addr.sun_path, sizeof(daemonSocketPath));
+    signal(SIGINT, RemoveDaemonSocket);
+    signal(SIGTERM, RemoveDaemonSocket);
+    signal(SIGPIPE, SIG_IGN);
+    printf("bcpp: daemon listening on %s\n", addr.sun_path);
+
+    const String request = DaemonRequest(opts);
+    // Changes closer together than this regenerate once
+    const double debounceMs = 50;
+
+    FileWatcher watcher;
+    WatchFiles(&watcher, BuildLibInputs(opts.buildDir));
+    bool dirty = true;
+    double dirtySince = 0;
+    pid_t child = -1;
+    int childOutputFd = -1;
+    std::vector<char> childOutput;
+    double childStart = 0;
+    // Output of the latest finished generation, status line first
+    std::vector<char> result;
+    // Clients still sending their request, read as it arrives so a slow or
+    // stuck client can't hold up the others
+    struct DaemonClient {
+        int fd;
+        std::vector<char> request;
+    };
+    std::vector<DaemonClient> readingClients;
+    std::vector<int> waitingClients;
+    std::vector<pollfd> fds;
+
+    for (;;) {
+        if (dirty && child < 0 && (!waitingClients.empty() || NowMs() - dirtySince >= debounceMs)) {
+            dirty = false;
+            childOutput.clear();
+            childStart = NowMs();
+            child = StartGeneration(opts, &childOutputFd);
+        }
+
+        fds.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        fds.push_back({child >= 0 ? childOutputFd : -1, POLLIN, 0});
+#ifdef __linux__
+        fds.push_back({watcher.fd, POLLIN, 0});
+        int timeout = -1;
+#else
+        fds.push_back({-1, POLLIN, 0});
+        int timeout = 250;
+#endif
+        const size_t firstClient = fds.size();
+        for (const DaemonClient& c : readingClients) {
+            fds.push_back({c.fd, POLLIN, 0});
+        }
+        if (dirty && child < 0) {
+            timeout = int(debounceMs);
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            continue;
+        }
+
+        // Check for changes before answering clients so an edit made just
+        // before running buildcpp is never answered with stale output
+        if (WatchedFilesChanged(&watcher)) {
+            if (!dirty) {
+                dirtySince = NowMs();
+            }
+            dirty = true;
+        }
+
+        // A request is complete once the client shuts down its end
+        for (size_t i = readingClients.size(); i-- > 0;) {
+            if (!(fds[firstClient + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            DaemonClient& c = readingClients[i];
+            char buf[4096];
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n > 0) {
+                c.request.insert(c.request.end(), buf, buf + n);
+                if (c.request.size() <= request.Len()) continue;
+            }
+            if (n == 0 && c.request.size() == request.Len() &&
+                memcmp(c.request.data(), request.CStr(), request.Len()) == 0) {
+                // Replies are written in one go, blocking for a few seconds
+                // at most on a client that stopped reading
+                timeval sendTimeout = {5, 0};
+                fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) & ~O_NONBLOCK);
+                setsockopt(c.fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+                waitingClients.push_back(c.fd);
+            } else {
+                WriteAll(c.fd, "options differ\n", 15);
+                close(c.fd);
+            }
+            readingClients.erase(readingClients.begin() + i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int client = accept(listenFd, nullptr, nullptr);
+            if (client >= 0) {
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+                readingClients.push_back({client, {}});
+            }
+        }
+
+        if (child >= 0 && (fds[1].revents & (POLLIN | POLLHUP))) {
+            char buf[4096];
+            ssize_t n = read(childOutputFd, buf, sizeof(buf));
+            if (n > 0) {
+                childOutput.insert(childOutput.end(), buf, buf + n);
+            } else if (n == 0) {
+                close(childOutputFd);
+                int status = 0;
+                waitpid(child, &status, 0);
+                child = -1;
+                int exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+                fwrite(childOutput.data(), 1, childOutput.size(), stdout);
+                printf("bcpp: daemon generation %s in %.0f ms\n",
+                       exitStatus == 0 ? "finished" : "failed", NowMs() - childStart);
+                fflush(stdout);
+
+                String statusLine = FormatString("%d\n", exitStatus);
+                result.assign(statusLine.CStr(), statusLine.CStr() + statusLine.Len());
+                result.insert(result.end(), childOutput.begin(), childOutput.end());
+                // build.cpp may include different headers now. A failed
+                // compile may not have written its depfile, so keep watching
+                // what the last good one listed too.
+                std::vector<String> inputs = BuildLibInputs(opts.buildDir);
+                if (exitStatus != 0) {
+                    inputs.insert(inputs.end(), watcher.paths.begin(), watcher.paths.end());
+                }
+                WatchFiles(&watcher, std::move(inputs));
+            }
+        }
+
+        if (!dirty && child < 0) {
+            for (int client : waitingClients) {
+                WriteAll(client, result.data(), result.size());
+                close(client);
+            }
+            waitingClients.clear();
+        }
+    }
+}
+
+/*
+ * `buildcpp --watch builddir` regenerates whenever build.cpp or a header it
+ * includes changes. Like the daemon's, each generation runs in a child from
+ * StartGeneration(), so build.so, the strings it created and everything else
+ * the generation allocated go away with the child, a long running watch
+ * doesn't grow, and a Fatal() in a broken build.cpp only ends that
+ * generation.
+ */
+
+// Blocks until a watched file changes and then stays quiet for debounceMs
+void WaitForChange(FileWatcher* watcher, double debounceMs) {
+    bool changed = false;
+    for (;;) {
+#ifdef __linux__
+        pollfd fd = {watcher->fd, POLLIN, 0};
+        int ready = poll(&fd, 1, changed ? int(debounceMs) : -1);
+#else
+        usleep(changed ? useconds_t(debounceMs * 1000) : 250 * 1000);
+        int ready = 1;
+#endif
+        bool more = ready > 0 && WatchedFilesChanged(watcher);
+        if (changed && !more) {
+            return;
+        }
+        changed |= more;
+    }
+}
+
+int RunWatch(const ConfigureOptions& opts) {
+    FileWatcher watcher;
+    for (int generation = 1;; generation++) {
+        double start = NowMs();
+        int outputFd = -1;
+        pid_t child = StartGeneration(opts, &outputFd, true);
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(outputFd, buf, sizeof(buf))) != 0) {
+            if (n > 0) {
+                fwrite(buf, 1, n, stdout);
+                fflush(stdout);
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        close(outputFd);
+        int status = 0;
+        waitpid(child, &status, 0);
+        bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        printf("bcpp: generation %d %s in %.0f ms, watching for changes to build.cpp\n", generation,
+               failed ? "failed" : "finished", NowMs() - start);
+        fflush(stdout);
+
+        // As in the daemon, a failed compile may not have written its
+        // depfile, so keep watching what the last good one listed too
+        std::vector<String> inputs = BuildLibInputs(opts.buildDir);
+        if (failed) {
+            inputs.insert(inputs.end(), watcher.paths.begin(), watcher.paths.end());
+        }
+        WatchFiles(&watcher, std::move(inputs));
+        WaitForChange(&watcher, 50);
+    }
+}
+
+/*
+ * `buildcpp --verify builddir` checks that the build doesn't depend on where
+ * the project is checked out. It copies the project into two directories
+ * whose paths differ in length, generates and builds each with Ninja, and
+ * compares everything the two builds wrote. Ninja's logs, the compile
+ * database and buildcpp's own build.so are expected to differ and skipped.
+ */
+
+// Lists the regular files under dir, relative to it
+void ListFiles(const String& dir, const String& prefix, std::vector<String>* files) {
+    DIR* d = opendir(dir.CStr());
+    if (!d) {
+        return;
+    }
+    while (dirent* ent = readdir(d)) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        String path = FormatString("%s/%s", dir.CStr(), ent->d_name);
+        String relative = prefix.Empty() ? NewString(ent->d_name)
+                                         : FormatString("%s/%s", prefix.CStr(), ent->d_name);
+        if (IsDir(path)) {
+            ListFiles(path, relative, files);
+        } else if (IsFile(path)) {
+            files->push_back(relative);
+        }
+    }
+    closedir(d);
+}
+
+bool IsVerifySkipped(const String& path) {
+    String name = BaseName(path);
+    // build.so and its precompiled header belong to buildcpp, not the project
+    return name == ".ninja_log" || name == ".ninja_deps" || name == "compile_commands.json" ||
+           name == kEdgeLogName ||
+           name == "bcpp.sock" || strncmp(name.CStr(), "build.so", 8) == 0 ||
+           strncmp(name.CStr(), "bcpp_pch.h", 10) == 0;
+}
+
+int RunVerify(const ConfigureOptions& opts) {
+    if (opts.buildDir[0] == '/' || strncmp(opts.buildDir.CStr(), "..", 2) == 0) {
+        Fatal("--verify needs a build directory inside the project\n");
+    }
+    char tempDir[] = "/tmp/bcpp_verify.XXXXXX";
+    if (!mkdtemp(tempDir)) {
+        Fatal("Failed to make a temporary directory\n");
+    }
+    String ninja = GetEnv("NINJA", "ninja");
+    String checkouts[2] = {FormatString("%s/a", tempDir), FormatString("%s/checkout_b", tempDir)};
+    for (const String& checkout : checkouts) {
+        printf("bcpp: building a copy in %s\n", checkout.CStr());
+        fflush(stdout);
+        String copy = FormatString("mkdir -p %s && tar -cf - --exclude=./%s . | tar -xf - -C %s",
+                                   checkout.CStr(), opts.buildDir.CStr(), checkout.CStr());
+        String generate = FormatString("%s -C %s%s", opts.exePath.CStr(), checkout.CStr(),
+                                       opts.bcppCommandLine.CStr());
+        String build = FormatString("%s -C %s/%s", ninja.CStr(), checkout.CStr(), opts.buildDir.CStr());
+        for (const String& cmd : {copy, generate, build}) {
+            if (Run(cmd) != 0) {
+                Fatal("Failed to run %s\n", cmd.CStr());
+            }
+        }
+    }
+
+    std::vector<String> files[2];
+    for (int i = 0; i < 2; i++) {
+        ListFiles(FormatString("%s/%s", checkouts[i].CStr(), opts.buildDir.CStr()), String(), &files[i]);
+        files[i].erase(std::remove_if(files[i].begin(), files[i].end(), IsVerifySkipped), files[i].end());
+        std::sort(files[i].begin(), files[i].end(), [](const String& a, const String& b) {
+            return strcmp(a.CStr(), b.CStr()) < 0;
+        });
+    }
+    size_t compared = 0;
+    std::vector<String> differ;
+    for (const String& file : files[0]) {
+        auto other = std::lower_bound(files[1].begin(), files[1].end(), file, [](const String& a, const String& b) {
+            return strcmp(a.CStr(), b.CStr()) < 0;
+        });
+        MappedFile contents;
+        if (other == files[1].end() || !(*other == file) ||
+            !MapFile(FormatString("%s/%s/%s", checkouts[0].CStr(), opts.buildDir.CStr(), file.CStr()), &contents)) {
+            differ.push_back(file);
+            continue;
+        }
+        if (!FileContentsEqual(FormatString("%s/%s/%s", checkouts[1].CStr(), opts.buildDir.CStr(), file.CStr()),
+                               contents.data, contents.len)) {
+            differ.push_back(file);
+        }
+        UnmapFile(&contents);
+        compared++;
+    }
+    if (files[1].size() != files[0].size()) {
+        printf("bcpp: the builds wrote %zu and %zu files\n", files[0].size(), files[1].size());
+    }
+    if (differ.empty() && files[1].size() == files[0].size()) {
+        printf("bcpp: all %zu files are identical\n", compared);
+        Run(FormatString("rm -rf %s", tempDir));
+        return 0;
+    }
+    printf("bcpp: %zu of %zu files differ between %s and %s:\n", differ.size(), files[0].size(),
+           checkouts[0].CStr(), checkouts[1].CStr());
+    for (const String& file : differ) {
+        printf("  %s\n", file.CStr());
+    }
+    return 1;
+}
+
+/*
+ * Compiler cache
+ *
+ * `buildcpp cache-cxx <compile command>` runs a compile through a content
+ * addressed cache shared by every build directory on the machine, so a fresh
+ * checkout, or switching back to a branch built before, reuses objects
+ * instead of recompiling them. A compile is looked up two ways:
+ *
+ *   direct        the command and the compiler pick a manifest in the cache
+ *                 listing, for earlier compiles of that command, the files
+ *                 they read and their contents. If every file of one of them
+ *                 still matches, its result is used without running the
+ *                 compiler at all.
+ *   preprocessed  the command, the compiler and its -E output, for commands
+ *                 the manifest has no match for.
+ *
+ * A miss compiles and stores the object, depfile and diagnostics under the
+ * preprocessed key. Every compile then records what it read in the command's
+ * manifest, taken from the depfile it just wrote, since Ninja deletes
+ * depfiles once it has read them. Entries are evicted least recently used
+ * first once the cache grows past BCPP_CACHE_SIZE MB. Anything other than a
+ * plain -c compile runs uncached, so all of $cxx can be wrapped, links
+ * included.
+ */
+
+// 128 bits of hash so unrelated compiles never share an entry
+struct CacheKey {
+    uint64_t h[2] = {0, 0x9e3779b97f4a7c15ull};
+
+    void Add(const void* data, size_t len) {
+        h[0] = HashBytes(data, len, h[0]);
+        h[1] = HashBytes(data, len, h[1]);
+    }
+    // Includes the terminator so consecutive strings can't run together
+    void Add(const char* str) { Add(str, strlen(str) + 1); }
+};
+
+bool AddFile(CacheKey* key, const char* path) {
+    MappedFile file;
+    if (!MapFile(path, &file)) {
+        return false;
+    }
+    key->Add(path);
+    key->Add(file.data, file.len);
+    UnmapFile(&file);
+    return true;
+}
+
+// A compile command split into the parts the cache cares about
+struct CacheableCompile {
+    const char** argv = nullptr;
+    const char* output = nullptr;
+    const char* depfile = nullptr;
+    const char* source = nullptr;
+    // Files the output depends on that -E and the depfile don't show
+    std::vector<const char*> extraInputs;
+    // The working directory, if the command maps it out of the object with
+    // -ffile-prefix-map or -fdebug-prefix-map. Only then can checkouts in
+    // different directories share entries.
+    String remappedDir;
+};
+
+// Adds data with every occurrence of dir replaced by a placeholder
+void AddWithoutDir(CacheKey* key, const char* data, size_t len, const String& dir) {
+    const char* end = data + len;
+    while (!dir.Empty() && data < end) {
+        auto found = static_cast<const char*>(memmem(data, end - data, dir.CStr(), dir.Len()));
+        if (!found) {
+            break;
+        }
+        key->Add(data, found - data);
+        key->Add("$PWD");
+        data = found + dir.Len();
+    }
+    key->Add(data, end - data);
+}
+
+bool IsSourceFile(const char* arg) {
+    const char* ext = strrchr(arg, '.');
+    if (!ext) return false;
+    for (const char* sourceExt : {".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".m", ".mm"}) {
+        if (strcmp(ext, sourceExt) == 0) return true;
+    }
+    return false;
+}
+
+// Returns false for anything that isn't a compile of one source to one object
+bool ParseCacheableCompile(const char** argv, CacheableCompile* compile) {
+    compile->argv = argv;
+    bool compileOnly = false;
+    for (int i = 1; argv[i]; i++) {
+        const char* arg = argv[i];
+        bool takesValue = TakesSeparateValue(arg);
+        if (takesValue && !argv[i + 1]) {
+            return false;
+        }
+        if (strcmp(arg, "-c") == 0) {
+            compileOnly = true;
+        } else if (strcmp(arg, "-x") == 0 || strcmp(arg, "-") == 0) {
+            // Precompiled headers and stdin
+            return false;
+        } else if (strcmp(arg, "-o") == 0) {
+            compile->output = argv[i + 1];
+        } else if (strcmp(arg, "-MF") == 0) {
+            compile->depfile = argv[i + 1];
+        } else if (strcmp(arg, "-include-pch") == 0) {
+            compile->extraInputs.push_back(argv[i + 1]);
+        } else if (strncmp(arg, "-fprofile-use=", 14) == 0) {
+            compile->extraInputs.push_back(arg + 14);
+        } else if (strncmp(arg, "-fprofile-instr-use=", 20) == 0) {
+            compile->extraInputs.push_back(arg + 20);
+        } else if (strncmp(arg, "-ffile-prefix-map=", 18) == 0 || strncmp(arg, "-fdebug-prefix-map=", 19) == 0) {
+            String cwd = GetCwd();
+            const char* from = strchr(arg, '=') + 1;
+            if (strncmp(from, cwd.CStr(), cwd.Len()) == 0 && from[cwd.Len()] == '=') {
+                compile->remappedDir = cwd;
+            }
+        } else if (*arg != '-' && IsSourceFile(arg)) {
+            if (compile->source) {
+                return false;
+            }
+            compile->source = arg;
+        }
+        if (takesValue) {
+            i++;
+        }
+    }
+    return compileOnly && compile->output && compile->source;
+}
+
+// Hashes the command and the compiler, the part both lookups share
+bool CommandCacheKey(const CacheableCompile& compile, CacheKey* key) {
+    auto tempMem = BeginTempStringArena();
+    uint64_t compiler = 0;
+    if (!HashProgram(FindProgram(tempMem.arena, compile.argv[0]), &compiler)) {
+        return false;
+    }
+    key->Add(&compiler, sizeof(compiler));
+    for (int i = 0; compile.argv[i]; i++) {
+        AddWithoutDir(key, compile.argv[i], strlen(compile.argv[i]) + 1, compile.remappedDir);
+    }
+    for (const char* input : compile.extraInputs) {
+        if (!AddFile(key, input)) {
+            // GCC's -fprofile-use takes a directory
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs argv with outputFd (stdout or stderr) captured into output, and the
+// other one left alone or discarded. Returns the exit status, and the
+// command's resource usage in usage if given.
+int RunCaptured(const char** argv, int outputFd, bool discardOther, std::vector<char>* output,
+                struct rusage* usage = nullptr) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        Fatal("Failed to create pipe\n");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        Fatal("Failed to fork\n");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], outputFd);
+        close(fds[1]);
+        if (discardOther) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, outputFd == STDOUT_FILENO ? STDERR_FILENO : STDOUT_FILENO);
+        }
+        execvp(argv[0], const_cast<char* const*>(argv));
+        _exit(127);
+    }
+    close(fds[1]);
+    ReadAll(fds[0], output);
+    close(fds[0]);
+    int status = 0;
+    struct rusage ignored;
+    wait4(pid, &status, 0, usage ? usage : &ignored);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+struct CacheStats {
+    uint64_t directHits = 0;
+    uint64_t preprocessedHits = 0;
+    uint64_t misses = 0;
+    uint64_t uncacheable = 0;
+    uint64_t bytes = 0;
+};
+
+String CacheDir() {
+    String dir = GetEnv("BCPP_CACHE_DIR");
+    if (!dir.Empty()) {
+        return dir;
+    }
+    String xdg = GetEnv("XDG_CACHE_HOME");
+    return xdg.Empty() ? ConcatStrings(GetEnv("HOME"), "/.cache/buildcpp") : ConcatStrings(xdg, "/buildcpp");
+}
+
+uint64_t CacheSizeLimit() {
+    String mb = GetEnv("BCPP_CACHE_SIZE", "5120");
+    return strtoull(mb.CStr(), nullptr, 10) * 1024 * 1024;
+}
+
+// Path of one file of the entry for key, sharded by the key's first byte
+String CacheEntryPath(const String& cacheDir, const CacheKey& key, const char* ext) {
+    return FormatString("%s/%02x/%016llx%016llx%s", cacheDir.CStr(), unsigned(key.h[0] >> 56),
+                        static_cast<unsigned long long>(key.h[0]), static_cast<unsigned long long>(key.h[1]), ext);
+}
+
+/*
+ * Deletes the least recently used entries until the cache is back under 90%
+ * of limit, so eviction doesn't run again for every miss. Hits bump the
+ * modification time of an entry's files, which is what recency is judged by.
+ * Returns the size of what's left.
+ */
+uint64_t EvictCacheEntries(const String& cacheDir, uint64_t limit) {
+    struct CacheFile {
+        String path;
+        time_t mtime;
+        uint64_t size;
+    };
+    std::vector<CacheFile> files;
+    for (int shard = 0; shard < 256; shard++) {
+        String dirPath = FormatString("%s/%02x", cacheDir.CStr(), shard);
+        DIR* dir = opendir(dirPath.CStr());
+        if (!dir) {
+            continue;
+        }
+        while (dirent* ent = readdir(dir)) {
+            if (ent->d_name[0] == '.' || strstr(ent->d_name, ".tmp")) {
+                continue;
+            }
+            String path = FormatString("%s/%s", dirPath.CStr(), ent->d_name);
+            struct stat sb;
+            if (stat(path.CStr(), &sb) == 0) {
+                files.push_back({path, sb.st_mtime, uint64_t(sb.st_size)});
+            }
+        }
+        closedir(dir);
+    }
+
+    // Evict whole entries, judged by their most recently used file
+    auto stem = [](const String& path) { return ExtPos(path); };
+    std::sort(files.begin(), files.end(), [&](const CacheFile& a, const CacheFile& b) {
+        return strcmp(a.path.CStr(), b.path.CStr()) < 0;
+    });
+    struct Entry {
+        size_t first, count;
+        time_t mtime;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        total += files[i].size;
+        if (!entries.empty()) {
+            const String& prev = files[entries.back().first].path;
+            size_t len = stem(prev);
+            if (stem(files[i].path) == len && strncmp(prev.CStr(), files[i].path.CStr(), len) == 0) {
+                Entry& e = entries.back();
+                e.count++;
+                e.mtime = std::max(e.mtime, files[i].mtime);
+                e.size += files[i].size;
+                continue;
+            }
+        }
+        entries.push_back({i, 1, files[i].mtime, files[i].size});
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+    for (const Entry& e : entries) {
+        if (total <= limit / 10 * 9) {
+            break;
+        }
+        for (size_t i = e.first; i < e.first + e.count; i++) {
+            unlink(files[i].path.CStr());
+        }
+        total -= e.size;
+    }
+    return total;
+}
+
+/*
+ * Adds delta to the counters in cacheDir/stats, which every cache-cxx process
+ * updates under an exclusive lock. The process that pushes the cache past its
+ * size limit evicts while still holding the lock.
+ */
+CacheStats UpdateCacheStats(const String& cacheDir, const CacheStats& delta, bool reset = false) {
+    CacheStats stats;
+    String path = ConcatStrings(cacheDir, "/stats");
+    int fd = open(path.CStr(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return stats;
+    }
+    flock(fd, LOCK_EX);
+    char buf[256] = {};
+    if (pread(fd, buf, sizeof(buf) - 1, 0) > 0) {
+        unsigned long long v[5] = {};
+        sscanf(buf, "%llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4]);
+        stats = {v[0], v[1], v[2], v[3], v[4]};
+    }
+    if (reset) {
+        stats = CacheStats{0, 0, 0, 0, stats.bytes};
+    }
+    stats.directHits += delta.directHits;
+    stats.preprocessedHits += delta.preprocessedHits;
+    stats.misses += delta.misses;
+    stats.uncacheable += delta.uncacheable;
+    stats.bytes += delta.bytes;
+    uint64_t limit = CacheSizeLimit();
+    if (stats.bytes > limit) {
+        stats.bytes = EvictCacheEntries(cacheDir, limit);
+    }
+    int len = snprintf(buf, sizeof(buf), "%llu %llu %llu %llu %llu\n",
+                       static_cast<unsigned long long>(stats.directHits),
+                       static_cast<unsigned long long>(stats.preprocessedHits),
+                       static_cast<unsigned long long>(stats.misses),
+                       static_cast<unsigned long long>(stats.uncacheable),
+                       static_cast<unsigned long long>(stats.bytes));
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, len, 0) != len) {
+        fprintf(stderr, "bcpp: failed to update %s\n", path.CStr());
+    }
+    close(fd);
+    return stats;
+}
+
+void PrintCacheStats(const String& cacheDir, const CacheStats& stats) {
+    uint64_t lookups = stats.directHits + stats.preprocessedHits + stats.misses;
+    printf("cache directory     %s\n", cacheDir.CStr());
+    printf("direct hits         %llu\n", static_cast<unsigned long long>(stats.directHits));
+    printf("preprocessed hits   %llu\n", static_cast<unsigned long long>(stats.preprocessedHits));
+    printf("misses              %llu\n", static_cast<unsigned long long>(stats.misses));
+    printf("uncacheable         %llu\n", static_cast<unsigned long long>(stats.uncacheable));
+    printf("hit rate            %.1f%%\n",
+           lookups ? 100.0 * (stats.directHits + stats.preprocessedHits) / lookups : 0.0);
+    printf("cache size          %.1f of %llu MB\n", stats.bytes / (1024.0 * 1024.0),
+           static_cast<unsigned long long>(CacheSizeLimit() / (1024 * 1024)));
+}
+
+// Copies the cached entry for key to the compile's outputs. False if there is
+// no complete entry.
+bool ServeCacheEntry(const String& cacheDir, const CacheKey& key, const CacheableCompile& compile) {
+    auto tempMem = BeginTempStringArena();
+    String object = CacheEntryPath(cacheDir, key, ".o");
+    String depfile = CacheEntryPath(cacheDir, key, ".d");
+    String diagnostics = CacheEntryPath(cacheDir, key, ".stderr");
+    MappedFile objectFile, depFile;
+    if (!MapFile(object, &objectFile)) {
+        return false;
+    }
+    bool ok = !compile.depfile || MapFile(depfile, &depFile);
+    ok = ok && WriteFile(compile.output, objectFile.data, objectFile.len);
+    ok = ok && (!compile.depfile || WriteFile(compile.depfile, depFile.data, depFile.len));
+    UnmapFile(&objectFile);
+    if (compile.depfile) {
+        UnmapFile(&depFile);
+    }
+    if (!ok) {
+        return false;
+    }
+    MappedFile diagnosticsFile;
+    if (MapFile(diagnostics, &diagnosticsFile)) {
+        WriteAll(STDERR_FILENO, diagnosticsFile.data, diagnosticsFile.len);
+        UnmapFile(&diagnosticsFile);
+        utimensat(AT_FDCWD, diagnostics.CStr(), nullptr, 0);
+    }
+    // Mark the entry as recently used
+    utimensat(AT_FDCWD, object.CStr(), nullptr, 0);
+    utimensat(AT_FDCWD, depfile.CStr(), nullptr, 0);
+    return true;
+}
+
+// Stores the compile's outputs under key, returning the bytes added
+uint64_t StoreCacheEntry(const String& cacheDir, const CacheKey& key, const CacheableCompile& compile,
+                         const std::vector<char>& diagnostics) {
+    String object = CacheEntryPath(cacheDir, key, ".o");
+    MakeDir(DirName(object), true);
+    uint64_t bytes = 0;
+    MappedFile file;
+    if (compile.depfile && MapFile(compile.depfile, &file)) {
+        WriteFile(CacheEntryPath(cacheDir, key, ".d"), file.data, file.len);
+        bytes += file.len;
+        UnmapFile(&file);
+    }
+    if (!diagnostics.empty()) {
+        WriteFile(CacheEntryPath(cacheDir, key, ".stderr"), diagnostics.data(), diagnostics.size());
+        bytes += diagnostics.size();
+    }
+    // The object goes last, since its presence is what makes the entry a hit
+    if (MapFile(compile.output, &file)) {
+        WriteFile(object, file.data, file.len);
+        bytes += file.len;
+        UnmapFile(&file);
+    }
+    return bytes;
+}
+
+/*
+ * A manifest holds up to kManifestEntries results of one command, newest
+ * first. Each is a line with the result's key and how many inputs follow,
+ * then a line per input with the key of its path and contents and the path.
+ */
+static const size_t kManifestEntries = 16;
+
+struct ManifestEntry {
+    CacheKey result;
+    // The entry's lines, as they appear in the manifest
+    String text;
+};
+
+std::vector<ManifestEntry> ReadManifest(StringArena* arena, const String& path) {
+    std::vector<ManifestEntry> entries;
+    MappedFile file;
+    if (!MapFile(path, &file)) {
+        return entries;
+    }
+    const char* p = file.data;
+    const char* end = file.data + file.len;
+    while (p < end) {
+        unsigned long long h0 = 0, h1 = 0;
+        size_t numInputs = 0;
+        const char* entryStart = p;
+        const char* lineEnd = FindFirstByte(p, end, '\n');
+        if (!lineEnd || sscanf(p, "%16llx%16llx %zu", &h0, &h1, &numInputs) != 3) {
+            break;
+        }
+        p = lineEnd + 1;
+        for (size_t i = 0; i < numInputs && p; i++) {
+            lineEnd = FindFirstByte(p, end, '\n');
+            p = lineEnd ? lineEnd + 1 : nullptr;
+        }
+        if (!p) {
+            break;
+        }
+        ManifestEntry entry;
+        entry.result.h[0] = h0;
+        entry.result.h[1] = h1;
+        entry.text = NewString(arena, entryStart, p - entryStart);
+        entries.push_back(entry);
+    }
+    UnmapFile(&file);
+    return entries;
+}
+
+// Whether every input an entry lists still has the contents it had
+bool ManifestEntryMatches(const ManifestEntry& entry) {
+    auto tempMem = BeginTempStringArena();
+    const char* end = entry.text.CStr() + entry.text.Len();
+    const char* p = FindFirstByte(entry.text.CStr(), end, '\n') + 1;
+    while (p < end) {
+        const char* lineEnd = FindFirstByte(p, end, '\n');
+        unsigned long long h0 = 0, h1 = 0;
+        if (lineEnd - p < 34 || sscanf(p, "%16llx%16llx", &h0, &h1) != 2) {
+            return false;
+        }
+        String path = NewString(tempMem.arena, p + 33, lineEnd - (p + 33));
+        CacheKey input;
+        if (!AddFile(&input, path.CStr()) || input.h[0] != h0 || input.h[1] != h1) {
+            return false;
+        }
+        p = lineEnd + 1;
+    }
+    return true;
 }
 
-String ConsumeOneArg(int* i, int argc, const char** argv) {
-    if (*i + 1 == argc || *argv[*i + 1] == '-') {
-        Fatal("Expected one value after %s\n", argv[*i]);
+// Looks for an earlier compile of the command whose inputs all still match
+bool LookupManifest(const String& cacheDir, const CacheKey& commandKey, CacheKey* result) {
+    auto tempMem = BeginTempStringArena();
+    for (const ManifestEntry& entry : ReadManifest(tempMem.arena, CacheEntryPath(cacheDir, commandKey, ".manifest"))) {
+        if (ManifestEntryMatches(entry)) {
+            *result = entry.result;
+            return true;
+        }
     }
-    return NewString(argv[++(*i)]);
+    return false;
 }
 
-#ifdef BUILDCPP_MAIN
-
-int main(int argc, const char** argv) {
-    InitBuildCpp();
+/*
+ * Records that the command produced result from the inputs its depfile
+ * lists. Inputs modified at or after modifiedBefore may not be what the
+ * compiler read, so then nothing is recorded. Returns how many bytes the
+ * manifest grew by.
+ */
+int64_t UpdateManifest(const String& cacheDir, const CacheKey& commandKey, const CacheKey& result,
+                       const char* depfile, timespec modifiedBefore) {
+    auto tempMem = BeginTempStringArena();
+    MappedFile file;
+    if (!MapFile(depfile, &file)) {
+        return 0;
+    }
+    auto deps = ParseDepfile(tempMem.arena, file.data, file.len);
+    UnmapFile(&file);
+    if (deps.empty()) {
+        return 0;
+    }
 
-    // Command line args
-    String changeDir;
-    String buildDir;
-    String installPrefix = "/usr/local";
-    
-    String exePath = GetExecutablePath();
-    String bcppCommandLine;
-    for (int i = 1; i < argc; i++) {
-        if (*argv[i] == '-') {
-            if (IsArg(argv[i], "-C")) {
-                changeDir = ConsumeOneArg(&i, argc, argv);
-            } else if (IsArg(argv[i], "--prefix")) {
-                installPrefix = ConsumeOneArg(&i, argc, argv);
-                bcppCommandLine = FormatString("%s --prefix %s",
-                                        bcppCommandLine.CStr(), installPrefix.CStr());
-            } else if (IsArg(argv[i], "-h", "--help")) {
-                Usage();
-            } else {
-                Fatal("Unknown option %s\n", argv[i]);
-            }
-        } else {
-            buildDir = NewString(argv[i]);
-            bcppCommandLine = FormatString("%s %s", bcppCommandLine.CStr(), buildDir.CStr());
+    NinjaWriter w;
+    w.Append(FormatString(tempMem.arena, "%016llx%016llx %zu\n", static_cast<unsigned long long>(result.h[0]),
+                          static_cast<unsigned long long>(result.h[1]), deps.size()));
+    for (const String& dep : deps) {
+        CacheKey input;
+        if (!TimeBefore(ModTime(dep), modifiedBefore) || FindFirstByte(dep.CStr(), dep.CStr() + dep.Len(), '\n') ||
+            !AddFile(&input, dep.CStr())) {
+            return 0;
         }
+        w.Append(FormatString(tempMem.arena, "%016llx%016llx %s\n", static_cast<unsigned long long>(input.h[0]),
+                              static_cast<unsigned long long>(input.h[1]), dep.CStr()));
     }
 
-    if (buildDir.Empty()) {
-        Usage();
+    // The new entry goes first, replacing any older one with the same result
+    String path = CacheEntryPath(cacheDir, commandKey, ".manifest");
+    MakeDir(DirName(path), true);
+    size_t oldSize = FileSize(path);
+    std::vector<ManifestEntry> entries = ReadManifest(tempMem.arena, path);
+    size_t kept = 1;
+    for (const ManifestEntry& entry : entries) {
+        if (kept == kManifestEntries) break;
+        if (entry.result.h[0] == result.h[0] && entry.result.h[1] == result.h[1]) continue;
+        w.Append(entry.text);
+        kept++;
     }
-    if (!changeDir.Empty()) {
-        printf("bcpp: Entering directory '%s'\n", changeDir.CStr()); 
-        ChangeDir(changeDir);
+    if (!WriteFile(path, w.buf, w.used)) {
+        return 0;
     }
-    String root = GetCwd();
+    return int64_t(w.used) - int64_t(oldSize);
+}
 
-    if (!IsFile(String("build.cpp"))) {
-        Fatal("No build.cpp file in current directory\n");
+int CacheCxx(int argc, const char** argv) {
+    String cacheDir = CacheDir();
+    if (argc == 1 && (strcmp(argv[0], "--stats") == 0 || strcmp(argv[0], "--zero-stats") == 0)) {
+        MakeDir(DirName(cacheDir), true);
+        MakeDir(cacheDir, true);
+        PrintCacheStats(cacheDir, UpdateCacheStats(cacheDir, CacheStats(), strcmp(argv[0], "--zero-stats") == 0));
+        return 0;
+    }
+    // With --edge-log, compiles that run the compiler are recorded as run-edge
+    // would, and hits aren't, so the log keeps what a compile really costs
+    const char* edgeLog = nullptr;
+    if (argc >= 2 && strcmp(argv[0], "--edge-log") == 0) {
+        edgeLog = argv[1];
+        argc -= 2;
+        argv += 2;
     }
-    if (!MakeDir(buildDir, true)) {
-        Fatal("Failed to make directory \"%s\"\n", argv[1]);
+    if (argc == 0) {
+        Fatal("usage: buildcpp cache-cxx [--edge-log <log>] <compiler> <args>...\n"
+              "       buildcpp cache-cxx --stats | --zero-stats\n");
     }
 
-    // Build a relative path from buildDir back to root
-    String relativeRoot = RelativePath(root, buildDir);
-    bcppCommandLine = FormatString("%s -C %s", bcppCommandLine.CStr(), "$root");
-    
-    String exeDir = DirName(exePath);
-    String cxx = GetEnv("CXX", "c++");
+    // argv is null terminated as it came from main
+    CacheableCompile compile;
+    CacheKey commandKey;
+    if (!ParseCacheableCompile(argv, &compile) || !MakeDir(DirName(cacheDir), true) ||
+        !MakeDir(cacheDir, true) || !CommandCacheKey(compile, &commandKey)) {
+        CacheStats delta;
+        delta.uncacheable = 1;
+        UpdateCacheStats(cacheDir, delta);
+        if (edgeLog) {
+            return RunRecorded(edgeLog, argv);
+        }
+        execvp(argv[0], const_cast<char* const*>(argv));
+        Fatal("Failed to run %s\n", argv[0]);
+    }
 
-    String buildLib = ConcatStrings(buildDir, "/build.so");
-    auto cmd = FormatString(
-        "%s -std=c++17 -O2 -shared -Wl,-undefined,dynamic_lookup"
-        " -I%s/../include"
-        " -MD -MF build.so.d %s/build.cpp -o build.so", cxx.CStr(), exeDir.CStr(), relativeRoot.CStr());
-    if (RunInDir(cmd, buildDir) != 0) {
-        Fatal("Failed to run %s\n", cmd.CStr());
+    CacheStats delta;
+    timespec lookupStart = WallTime();
+    CacheKey directResult;
+    if (compile.depfile && LookupManifest(cacheDir, commandKey, &directResult) &&
+        ServeCacheEntry(cacheDir, directResult, compile)) {
+        delta.directHits = 1;
+        UpdateCacheStats(cacheDir, delta);
+        return 0;
     }
 
-    void* buildHandle = dlopen(buildLib.CStr(), RTLD_LAZY);
-    if (!buildHandle) {
-        Fatal("Failed to load \"%s\"\n", buildLib.CStr());
+    // Preprocess with -E in place of -c, without the output and depfile
+    std::vector<const char*> preprocessArgs;
+    for (int i = 0; argv[i]; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            preprocessArgs.push_back("-E");
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-MF") == 0 ||
+                   strcmp(argv[i], "-MT") == 0 || strcmp(argv[i], "-MQ") == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-MD") != 0 && strcmp(argv[i], "-MMD") != 0) {
+            preprocessArgs.push_back(argv[i]);
+        }
     }
-    auto bcppEntry = static_cast<BuildCppEntry*>(dlsym(buildHandle, "buildCppEntry"));
-    if (!bcppEntry) {
-        Fatal("Failed to find symbol \"bcppEntry\" in %s\n", buildLib.CStr());
+    preprocessArgs.push_back(nullptr);
+    std::vector<char> preprocessed;
+    CacheKey preprocessedKey = commandKey;
+    bool havePreprocessedKey = RunCaptured(preprocessArgs.data(), STDOUT_FILENO, true, &preprocessed) == 0;
+    if (havePreprocessedKey) {
+        preprocessedKey.Add("preprocessed");
+        // GCC names the working directory in -E output even when it's remapped
+        AddWithoutDir(&preprocessedKey, preprocessed.data(), preprocessed.size(), compile.remappedDir);
+        if (ServeCacheEntry(cacheDir, preprocessedKey, compile)) {
+            delta.preprocessedHits = 1;
+        }
     }
 
-    Toolchain toolchain;
-    Project project = bcppEntry->generate(toolchain);
-    const Compiler& comp = project.toolchain.compiler;
+    if (!delta.preprocessedHits) {
+        // Diagnostics are kept so hits can replay them
+        std::vector<char> diagnostics;
+        double compileStart = NowMs();
+        struct rusage usage;
+        int status = RunCaptured(argv, STDERR_FILENO, false, &diagnostics, &usage);
+        WriteAll(STDERR_FILENO, diagnostics.data(), diagnostics.size());
+        if (status != 0) {
+            return status;
+        }
+        if (edgeLog) {
+            AppendEdgeRecord(edgeLog, compile.output, NowMs() - compileStart, usage);
+        }
+        delta.misses = 1;
+        if (havePreprocessedKey) {
+            delta.bytes += StoreCacheEntry(cacheDir, preprocessedKey, compile, diagnostics);
+        }
+    }
 
-    String ninjaFile = ConcatStrings(buildDir, "/build.ninja");
-    FILE* ninja = fopen(ninjaFile.CStr(), "w");
-    if (!ninja) {
-        Fatal("Failed to open %s for writing\n", ninjaFile.CStr());
+    // Make the next compile of this command a direct hit while its inputs
+    // stay the same, in this build directory or any other
+    if (havePreprocessedKey && compile.depfile) {
+        delta.bytes += UpdateManifest(cacheDir, commandKey, preprocessedKey, compile.depfile, lookupStart);
     }
-    NinjaComment(ninja, "This file was generated by bcpp.");
-    NinjaNewline(ninja);
-    // Ninja globals
-    NinjaVariable(ninja, "ninja_required_version", "1.3");
+    UpdateCacheStats(cacheDir, delta);
+    return 0;
+}
 
-    NinjaVariable(ninja, "root", relativeRoot);
-    NinjaVariable(ninja, "builddir", "bcppout");
-    // Command line and args
-    NinjaVariable(ninja, "prefix", installPrefix);
-    NinjaVariable(ninja, "bcppexe", exePath);
-    NinjaVariable(ninja, "bcppcommandline", bcppCommandLine);
+/*
+ * Build report
+ *
+ * `buildcpp report [-n N] <builddir>` explains where a build's time went. It
+ * maps builddir/.ninja_log, takes the latest duration of each output and
+ * joins them against the edges the project plans, the same graph build.ninja
+ * is written from, to print:
+ *
+ *   critical path   the chain of dependent edges that took longest
+ *   slowest         the N slowest compiles and links
+ *   targets         each target's compile and link time, slowest first
+ *   parallelism     how many edges the last Ninja run had running over time,
+ *                   against the cores available
+ *
+ * Install edges aren't in the graph, so they only count towards parallelism.
+ */
 
-    // Compiler and Linker 
-    NinjaVariable(ninja, "cxx", "c++");
-    NinjaVariable(ninja, "ar", "ar");
+// Open addressing map from strings to indices, sized up front like
+// InternedIndexMap. Lookups take the bytes and hash of a key rather than an
+// InternedString, so .ninja_log lines are found without interning millions
+// of them. A zero hash marks an empty slot, and a removed key leaves its
+// hash with no index.
+struct HashIndexMap {
+    static constexpr size_t kAbsent = SIZE_MAX;
+
+    struct Slot {
+        uint64_t hash = 0;
+        String key;
+        size_t index = kAbsent;
+    };
+
+    explicit HashIndexMap(size_t maxEntries) {
+        size_t numSlots = 16;
+        while (numSlots < maxEntries * 2) numSlots *= 2;
+        slots.resize(numSlots);
+    }
 
-    // Install/System tools
+    // Stores index for key, replacing the index stored for it before
+    void Insert(const String& key, size_t index) {
+        uint64_t hash = HashString(key);
+        Slot& slot = slots[Probe(hash, key.CStr(), key.Len())];
+        slot.hash = Key(hash);
+        slot.key = key;
+        slot.index = index;
+    }
 
-    // Compiler and Linker Flags and Options
-    std::vector<String> cflags;
-    std::vector<String> ldflags;
+    // The index stored for the len bytes at key, whose HashBytes is hash
+    size_t Find(uint64_t hash, const char* key, size_t len) const {
+        return slots[Probe(hash, key, len)].index;
+    }
 
-    AppendStandard(cflags, comp.standard);
-    AppendBuildType(cflags, comp.buildType);
-    AppendFlag(cflags, comp.exceptions, "exceptions");
-    AppendFlag(cflags, comp.rtti, "rtti");
+    size_t Find(const String& key) const {
+        return Find(HashString(key), key.CStr(), key.Len());
+    }
 
-    cflags.reserve(cflags.size() + project.includeDirectories.size() + project.compileFlags.size());
-    for (const auto& dir : project.includeDirectories) {
-        AppendIncludeDirectory(cflags, dir);
+    // Finds the index for key like Find, and removes the key. Later lookups
+    // of it skip the slot by hash alone, without reading its bytes again.
+    size_t Take(uint64_t hash, const char* key, size_t len) {
+        Slot& slot = slots[Probe(hash, key, len)];
+        size_t index = slot.index;
+        if (slot.hash != 0) {
+            slot.key = String();
+            slot.index = kAbsent;
+        }
+        return index;
     }
-    for (const auto& flag : project.compileFlags) {
-        AppendCompileFlag(cflags, flag);
+
+    // Starts loading the slot hash probes first, for lookups that would
+    // otherwise each wait on a cache miss
+    void Prefetch(uint64_t hash) const {
+        __builtin_prefetch(&slots[Key(hash) & (slots.size() - 1)]);
     }
 
-    ldflags.reserve(ldflags.size() + project.linkDirectories.size() + project.linkFlags.size());
-    for (const auto& dir : project.linkDirectories) {
-        AppendLinkDirectory(ldflags, dir);
+    // Then starts loading the bytes of the key stored for hash, once its slot
+    // is in cache, for the comparison Find makes
+    void PrefetchKey(uint64_t hash) const {
+        size_t mask = slots.size() - 1;
+        for (size_t slot = Key(hash) & mask; slots[slot].hash != 0; slot = (slot + 1) & mask) {
+            if (slots[slot].hash == Key(hash) && slots[slot].index != kAbsent) {
+                __builtin_prefetch(slots[slot].key.CStr());
+                return;
+            }
+        }
     }
-    for (const auto& flag : project.linkFlags) {
-        AppendLinkFlag(ldflags, flag);
+
+    static uint64_t Key(uint64_t hash) { return hash ? hash : 1; }
+
+    // The slot holding key, or the empty slot it would go in. Hashes are
+    // compared first so the bytes are only read for the slot that matches.
+    size_t Probe(uint64_t hash, const char* key, size_t len) const {
+        hash = Key(hash);
+        size_t mask = slots.size() - 1;
+        size_t slot = hash & mask;
+        while (slots[slot].hash != 0 &&
+               (slots[slot].hash != hash || slots[slot].index == kAbsent || slots[slot].key.Len() != len ||
+                memcmp(slots[slot].key.CStr(), key, len) != 0)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
     }
 
-    NinjaVariable(ninja, "cflags", cflags);
-    NinjaVariable(ninja, "ldflags", ldflags);
-    
-    NinjaNewline(ninja);
+    std::vector<Slot> slots;
+};
 
-    // Compiler and Linker rules 
-    NinjaRule(ninja, "cxx", "$cxx -MD -MF $out.d $cflags -c $in -o $out", 
-                  {{"description", {"CXX $out"}}, {"depfile", {"$out.d"}}, {"deps", {"gcc"}}});
-    NinjaNewline(ninja);
+// One line of .ninja_log, pointing into the mapped file
+struct NinjaLogEntry {
+    uint32_t startMs;
+    uint32_t endMs;
+    // Parsed on demand with ParseLogNumber, since most lines never need it
+    const char* mtime;
+    const char* output;
+    uint32_t outputLen;
+};
 
-    NinjaRule(ninja, "ar", "rm -f $out && $ar crs $out $in", {{"description", {"AR $out"}}}); 
-    NinjaNewline(ninja);
+const char* ParseLogNumber(const char* p, const char* end, uint64_t* value) {
+    uint64_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *value = v;
+    return p;
+}
 
-    NinjaRule(ninja, "link", "$cxx $ldflags -o $out $in $libs", {{"description", {"LINK $out"}}});
-    NinjaNewline(ninja);
+const char* ParseLogNumber(const char* p, const char* end, uint32_t* value) {
+    uint64_t v = 0;
+    p = ParseLogNumber(p, end, &v);
+    *value = uint32_t(v);
+    return p;
+}
 
-    // Install Rules
-    NinjaRule(ninja, "cp", "cp -pR $in $out", {{"description", {"INSTALL $out"}}});
-    NinjaNewline(ninja);
+/*
+ * Reads a version 5 or later .ninja_log newest line first. Lines are start
+ * and end times in ms since the run began, mtime, output and command hash.
+ * Reading backwards finds each output's latest run first, so a report can
+ * stop as soon as it has every edge it wants instead of parsing years of
+ * history.
+ */
+struct NinjaLogReader {
+    const char* begin = nullptr;
+    const char* pos = nullptr;
+
+    bool Open(const MappedFile& log) {
+        const char* end = log.data + log.len;
+        if (log.len < 15 || memcmp(log.data, "# ninja log v", 13) != 0 || atoi(log.data + 13) < 5) {
+            return false;
+        }
+        begin = FindFirstByte(log.data, end, '\n');
+        begin = begin ? begin + 1 : end;
+        pos = end;
+        return true;
+    }
 
-    // Targets
-    std::vector<String> allInstallTargets;
-    for (const auto& target : project.targets) {
-        // We create a lot of temp strings per target
-        auto tempMem = BeginTempStringArena();
+    bool Previous(NinjaLogEntry* entry) {
+        while (pos > begin) {
+            const char* lineEnd = pos[-1] == '\n' ? pos - 1 : pos;
+            const char* newline = FindLastByte(begin, lineEnd, '\n');
+            const char* line = newline ? newline + 1 : begin;
+            pos = line;
+
+            const char* p = ParseLogNumber(line, lineEnd, &entry->startMs);
+            if (p == lineEnd || *p != '\t') continue;
+            p = ParseLogNumber(p + 1, lineEnd, &entry->endMs);
+            if (p == lineEnd || *p != '\t') continue;
+            const char* mtimeEnd = FindFirstByte(p + 1, lineEnd, '\t');
+            if (!mtimeEnd) continue;
+            entry->mtime = p + 1;
+            const char* outputEnd = FindFirstByte(mtimeEnd + 1, lineEnd, '\t');
+            if (!outputEnd) continue;
+            entry->output = mtimeEnd + 1;
+            entry->outputLen = uint32_t(outputEnd - entry->output);
+            return true;
+        }
+        return false;
+    }
+};
+
+/*
+ * Finds where the last Ninja run begins in a log read newest line first.
+ * Ninja appends lines as edges finish, so end times only go down until the
+ * run before. That alone isn't enough: Ninja recompacts a long log when a
+ * run starts, rewriting the older lines in no particular order, so the line
+ * before the run can happen to end earlier than its first edge.
+ *
+ * Every output of the last run was written after the run started, so its
+ * mtime, in nanoseconds since Ninja 1.9, tells it apart too. The start is
+ * estimated from the newest line as its mtime less its end time, which never
+ * runs late whether Ninja logged the output's mtime or, from 1.11, the time
+ * the command started. Logs without nanosecond mtimes fall back to end times
+ * alone, and the report warns that older runs may be counted.
+ */
+struct LastRunFinder {
+    // Slack for filesystems that store mtimes coarser than Ninja's clock
+    static constexpr int64_t kMtimeSlackNs = 1000000000;
+    // Any nanosecond mtime after 1970-01-12 is above this, and no seconds one is
+    static constexpr int64_t kMinMtimeNs = 1000000000000000;
+
+    bool ended = false;
+    bool byMtime = false;
+    int64_t startNs = 0;
+    uint32_t prevEndMs = 0;
+    size_t numEntries = 0;
+
+    // Whether entry, the next line back, belongs to the last run
+    bool Add(const NinjaLogEntry& entry) {
+        if (ended) {
+            return false;
+        }
+        uint64_t mtime = 0;
+        ParseLogNumber(entry.mtime, entry.output, &mtime);
+        if (numEntries == 0) {
+            startNs = int64_t(mtime) - int64_t(entry.endMs) * 1000000;
+            byMtime = startNs > kMinMtimeNs;
+        } else if (entry.endMs > prevEndMs || (byMtime && int64_t(mtime) < startNs - kMtimeSlackNs)) {
+            ended = true;
+            return false;
+        }
+        prevEndMs = entry.endMs;
+        numEntries++;
+        return true;
+    }
+};
 
-        std::vector<NinjaVar> extraCompileVars;
-        if (!target.includeDirectories.empty() || !target.compileFlags.empty()) {
-            std::vector<String> targetCFlags;
-            targetCFlags.reserve(target.includeDirectories.size() + target.compileFlags.size() + 1);
-            targetCFlags.emplace_back("$cflags");
-            for (const auto& dir : target.includeDirectories) {
-                AppendIncludeDirectory(targetCFlags, dir);
+enum class ReportEdgeKind { Generate, Phony, Pch, Compile, Link, Archive, PgoTrain };
+
+// An edge of the planned build with its duration from the log and the
+// longest chain of edges ending with it
+struct ReportEdge {
+    // As Ninja names it in .ninja_log
+    String output;
+    size_t target;
+    ReportEdgeKind kind;
+    std::vector<size_t> deps;
+    uint32_t ms = 0;
+    uint64_t finishMs = 0;
+    // The dependency on that chain, or kAbsent
+    size_t critical = HashIndexMap::kAbsent;
+};
+
+/*
+ * The edges PlanTargetObjects plans for every target, each depending on
+ * what its Ninja build statement names as inputs: generated headers, the
+ * PCH, objects, the libraries linked and for PGO the training run.
+ */
+std::vector<ReportEdge> PlanReportEdges(const std::vector<Target>& targets, const std::vector<TargetObjects>& plan,
+                                        bool clang, HashIndexMap* edgeIndices) {
+    std::vector<ReportEdge> edges;
+    std::vector<std::vector<String>> depPaths;
+    auto addEdge = [&](const String& output, size_t t, ReportEdgeKind kind, std::vector<String> deps) {
+        ReportEdge edge;
+        edge.output = ExpandBuildDir(&stringArena, output);
+        edge.target = t;
+        edge.kind = kind;
+        edges.push_back(std::move(edge));
+        depPaths.emplace_back(std::move(deps));
+    };
+    for (size_t t = 0; t < targets.size(); t++) {
+        const Target& target = targets[t];
+        const TargetObjects& objs = plan[t];
+        if (!target.generatedHeaders.empty()) {
+            std::vector<String> headers;
+            for (const auto& header : target.generatedHeaders) {
+                headers.emplace_back(ConcatStrings("$builddir/", header.output));
+                addEdge(headers.back(), t, ReportEdgeKind::Generate, {});
             }
-            for (const auto& flag : target.compileFlags) {
-                AppendCompileFlag(targetCFlags, flag);
+            addEdge(GeneratedHeadersPhony(&stringArena, target), t, ReportEdgeKind::Phony, headers);
+        }
+        std::vector<String> compileDeps = objs.generatedHeaders;
+        if (objs.pch != InternedString()) {
+            if (objs.buildsPch) {
+                addEdge(objs.pch.Str(), t, ReportEdgeKind::Pch, objs.generatedHeaders);
+            }
+            compileDeps.push_back(objs.pch.Str());
+        }
+        TargetOutput out = GetTargetOutput(&stringArena, target);
+        if (!target.pgoTrainingCommand.Empty()) {
+            String genDir = PgoObjectDir(&stringArena, target, "pgo-gen");
+            size_t useDirLen = PgoObjectDir(&stringArena, target, "pgo-use").Len();
+            std::vector<String> genObjects;
+            for (const auto& object : objs.objects) {
+                genObjects.emplace_back(ConcatStrings(genDir, object.Str().CStr() + useDirLen));
+                addEdge(genObjects.back(), t, ReportEdgeKind::Compile, compileDeps);
+            }
+            String genExe = FormatString("%s/%s", genDir.CStr(), out.path.CStr());
+            genObjects.insert(genObjects.end(), objs.libs.begin(), objs.libs.end());
+            addEdge(genExe, t, ReportEdgeKind::Link, genObjects);
+            String profile = PgoProfile(&stringArena, target, clang);
+            addEdge(profile, t, ReportEdgeKind::PgoTrain, {genExe});
+            compileDeps.push_back(profile);
+        }
+        std::vector<String> objects;
+        for (size_t i = 0; i < objs.objects.size(); i++) {
+            objects.push_back(objs.objects[i].Str());
+            if (objs.buildsObject[i]) {
+                addEdge(objects.back(), t, ReportEdgeKind::Compile, compileDeps);
             }
-            extraCompileVars.push_back(NinjaVar{"cflags", targetCFlags});
         }
+        objects.insert(objects.end(), objs.libs.begin(), objs.libs.end());
+        addEdge(out.path, t, IsLinked(target) ? ReportEdgeKind::Link : ReportEdgeKind::Archive, objects);
+    }
 
-        std::vector<String> objectFiles;
-        objectFiles.reserve(target.inputs.size());
-        for (const auto& i : target.inputs) {
-            auto pair = SplitExt(tempMem.arena, i);
-            objectFiles.emplace_back(FormatString(tempMem.arena, "$builddir/%s.o", pair.first.CStr()));
-            NinjaBuild(ninja, objectFiles.back(), "cxx", {ConcatStrings(tempMem.arena, "$root/", i)}, extraCompileVars);
+    *edgeIndices = HashIndexMap(edges.size());
+    for (size_t e = 0; e < edges.size(); e++) {
+        edgeIndices->Insert(edges[e].output, e);
+    }
+    for (size_t e = 0; e < edges.size(); e++) {
+        for (const auto& path : depPaths[e]) {
+            auto tempMem = BeginTempStringArena();
+            size_t dep = edgeIndices->Find(ExpandBuildDir(tempMem.arena, path));
+            if (dep != HashIndexMap::kAbsent) {
+                edges[e].deps.push_back(dep);
+            }
         }
+    }
+    return edges;
+}
 
-        std::vector<NinjaVar> extraLinkVars;
-        if (!target.linkFlags.empty() || !target.linkDirectories.empty()) {
-            std::vector<String> targetLdFlags;
-            targetLdFlags.reserve(target.linkFlags.size() + target.linkDirectories.size() + 1);
-            targetLdFlags.emplace_back("$ldflags");
-            for (const auto& dir : target.linkDirectories) {
-                AppendLinkDirectory(targetLdFlags, dir);
+// Fills in finishMs and critical for every edge, dependencies first
+void ComputeCriticalPaths(std::vector<ReportEdge>* edges) {
+    std::vector<bool> done(edges->size());
+    std::vector<size_t> stack;
+    for (size_t root = 0; root < edges->size(); root++) {
+        stack.push_back(root);
+        while (!stack.empty()) {
+            size_t e = stack.back();
+            if (done[e]) {
+                stack.pop_back();
+                continue;
+            }
+            ReportEdge& edge = (*edges)[e];
+            bool ready = true;
+            for (size_t dep : edge.deps) {
+                if (!done[dep]) {
+                    stack.push_back(dep);
+                    ready = false;
+                }
             }
-            for (const auto& linkFlag : target.linkFlags) {
-                AppendLinkFlag(targetLdFlags, linkFlag); 
+            if (!ready) continue;
+            for (size_t dep : edge.deps) {
+                if (edge.critical == HashIndexMap::kAbsent || (*edges)[dep].finishMs > (*edges)[edge.critical].finishMs) {
+                    edge.critical = dep;
+                }
             }
-            extraLinkVars.push_back(NinjaVar{"ldflags", targetLdFlags});
+            edge.finishMs = edge.ms + (edge.critical == HashIndexMap::kAbsent ? 0 : (*edges)[edge.critical].finishMs);
+            done[e] = true;
+            stack.pop_back();
         }
-        String targetOut;
-        String buildRule;
-        String installDir;
-        switch (target.type) {
-            case TargetType::Executable:
-                targetOut = target.name;
-                buildRule = "link";
-                installDir = "bin";
-                break;
-            case TargetType::StaticLibrary:
-                targetOut = ConcatStrings(tempMem.arena, target.name, ".a");
-                buildRule = "ar";
-                installDir = "lib";
-                break;
-            case TargetType::SharedLibrary:
-                targetOut = ConcatStrings(tempMem.arena, target.name, ".so");
-                buildRule = "link";
-                installDir = "lib";
-                break;
-            case TargetType::MacOSBundle:
-                Fatal("MacOSBundle target type not implemented yet\n");
-                break;
-        } 
-        NinjaBuild(ninja, targetOut, buildRule, objectFiles, extraLinkVars);
+    }
+}
+
+double Seconds(uint64_t ms) {
+    return ms / 1000.0;
+}
 
-        if (target.isDefault) {
-            NinjaDefault(ninja, target.name);
+// Prints the numEdges slowest edges of the given kinds
+void PrintSlowestEdges(const char* title, const std::vector<ReportEdge>& edges, const std::vector<Target>& targets,
+                       std::initializer_list<ReportEdgeKind> kinds, size_t numEdges) {
+    std::vector<size_t> slowest;
+    for (size_t e = 0; e < edges.size(); e++) {
+        if (edges[e].ms && std::find(kinds.begin(), kinds.end(), edges[e].kind) != kinds.end()) {
+            slowest.push_back(e);
         }
+    }
+    numEdges = std::min(numEdges, slowest.size());
+    std::partial_sort(slowest.begin(), slowest.begin() + numEdges, slowest.end(),
+                      [&](size_t a, size_t b) { return edges[a].ms > edges[b].ms; });
+    printf("\n%s\n     time  output\n", title);
+    for (size_t i = 0; i < numEdges; i++) {
+        const ReportEdge& edge = edges[slowest[i]];
+        printf("  %7.2f  %s (%s)\n", Seconds(edge.ms), edge.output.CStr(), targets[edge.target].name.CStr());
+    }
+}
 
-        if (target.install) {
-            String installOut = FormatString("$prefix/%s/%s", installDir.CStr(), targetOut.CStr());
-            NinjaBuild(ninja, installOut, "cp", {target.name});
-            allInstallTargets.emplace_back(installOut);
+void PrintTargetTotals(const std::vector<ReportEdge>& edges, const std::vector<Target>& targets, size_t numTargets) {
+    struct Totals {
+        uint64_t compileMs = 0;
+        uint64_t linkMs = 0;
+        uint64_t totalMs = 0;
+        size_t numEdges = 0;
+    };
+    std::vector<Totals> totals(targets.size());
+    for (const auto& edge : edges) {
+        Totals& total = totals[edge.target];
+        if (!edge.ms) continue;
+        if (edge.kind == ReportEdgeKind::Compile || edge.kind == ReportEdgeKind::Pch) {
+            total.compileMs += edge.ms;
+        } else if (edge.kind == ReportEdgeKind::Link || edge.kind == ReportEdgeKind::Archive) {
+            total.linkMs += edge.ms;
+        }
+        total.totalMs += edge.ms;
+        total.numEdges++;
+    }
+    std::vector<size_t> order;
+    for (size_t t = 0; t < targets.size(); t++) {
+        if (totals[t].numEdges) {
+            order.push_back(t);
         }
-        NinjaNewline(ninja);
     }
+    numTargets = std::min(numTargets, order.size());
+    std::partial_sort(order.begin(), order.begin() + numTargets, order.end(),
+                      [&](size_t a, size_t b) { return totals[a].totalMs > totals[b].totalMs; });
+    printf("\nTargets by total time\n    total  compile     link  edges  target\n");
+    for (size_t i = 0; i < numTargets; i++) {
+        const Totals& total = totals[order[i]];
+        printf("  %7.2f  %7.2f  %7.2f  %5zu  %s\n", Seconds(total.totalMs), Seconds(total.compileMs),
+               Seconds(total.linkMs), total.numEdges, targets[order[i]].name.CStr());
+    }
+}
 
-    // Install
-    for (const auto& installHeaders : project.installHeaders) {
-        for (const auto& header : installHeaders.headers) {
-            String installName = FormatString("$prefix/include/%s/%s",
-                                    installHeaders.subdir.CStr(), BaseName(header).CStr());
-            NinjaBuild(ninja, installName, "cp", {ConcatStrings("$root/", header)});
-            allInstallTargets.emplace_back(installName);
+// How many of a run's edges were running over time, in numRows slices
+void PrintParallelism(const std::vector<NinjaLogEntry>& entries, size_t numRows) {
+    uint32_t startMs = UINT32_MAX;
+    uint32_t endMs = 0;
+    uint64_t busyMs = 0;
+    for (const auto& entry : entries) {
+        startMs = std::min(startMs, entry.startMs);
+        endMs = std::max(endMs, entry.endMs);
+        busyMs += entry.endMs - std::min(entry.startMs, entry.endMs);
+    }
+    if (endMs <= startMs) {
+        return;
+    }
+    uint64_t wallMs = endMs - startMs;
+    std::vector<double> running(numRows);
+    double rowMs = double(wallMs) / numRows;
+    for (const auto& entry : entries) {
+        double begin = entry.startMs - startMs;
+        double end = entry.endMs - startMs;
+        for (size_t row = size_t(begin / rowMs); row < numRows && row * rowMs < end; row++) {
+            double overlap = std::min(end, (row + 1) * rowMs) - std::max(begin, row * rowMs);
+            running[row] += std::max(0.0, overlap) / rowMs;
         }
     }
-    NinjaNewline(ninja);
-    if (!allInstallTargets.empty()) {
-        NinjaBuild(ninja, "install", "phony", allInstallTargets);
-        NinjaNewline(ninja);
+
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double average = double(busyMs) / wallMs;
+    printf("\nParallelism: %.1f edges running on average over %.2f s, %zu core%s available (%.0f%%)\n",
+           average, Seconds(wallMs), cores, cores == 1 ? "" : "s", 100.0 * average / cores);
+    printf("     time  running\n");
+    double scale = std::max(double(cores), *std::max_element(running.begin(), running.end()));
+    const int kBarWidth = 50;
+    for (size_t row = 0; row < numRows; row++) {
+        int width = int(running[row] / scale * kBarWidth + 0.5);
+        printf("  %7.2f  %7.1f  %.*s%*s|\n", Seconds(uint64_t(row * rowMs)), running[row],
+               width, "##################################################", kBarWidth - width, "");
     }
+}
 
-    // #SoMeta
-    NinjaRule(ninja, "buildcpp", "$bcppexe $bcppcommandline", {{"generator", {"1"}},
-             {"depfile", {"build.so.d"}}, {"deps", {"gcc"}}});
-    NinjaBuild(ninja, "build.ninja", "buildcpp", {"$root/build.cpp"});
+int Report(int argc, const char** argv) {
+    String changeDir;
+    ConfigureOptions opts;
+    size_t topN = 10;
+    for (int i = 0; i < argc; i++) {
+        if (IsArg(argv[i], "-C")) {
+            changeDir = ConsumeOneArg(&i, argc, argv);
+        } else if (IsArg(argv[i], "-n")) {
+            topN = size_t(atoi(ConsumeOneArg(&i, argc, argv).CStr()));
+        } else if (*argv[i] == '-') {
+            Fatal("usage: buildcpp report [-C DIR] [-n N] <builddir>\n");
+        } else {
+            opts.buildDir = NewString(argv[i]);
+        }
+    }
+    if (opts.buildDir.Empty()) {
+        Fatal("usage: buildcpp report [-C DIR] [-n N] <builddir>\n");
+    }
+    if (!changeDir.Empty()) {
+        ChangeDir(changeDir);
+    }
+    if (!IsFile(String("build.cpp"))) {
+        Fatal("No build.cpp file in current directory\n");
+    }
+
+    opts.exePath = GetExecutablePath();
+    ConfigureResult result;
+    Project project = LoadProject(opts, RelativePath(GetCwd(), opts.buildDir), &result);
+    bool clang = UsesClang(project, "c++");
+    std::vector<TargetObjects> plan = PlanTargetObjects(project.targets, clang);
+    HashIndexMap edgeIndices(0);
+    std::vector<ReportEdge> edges = PlanReportEdges(project.targets, plan, clang, &edgeIndices);
+    size_t numWanted = std::count_if(edges.begin(), edges.end(),
+                                     [](const ReportEdge& e) { return e.kind != ReportEdgeKind::Phony; });
+
+    double readStart = NowMs();
+    String logPath = ConcatStrings(opts.buildDir, "/.ninja_log");
+    MappedFile log;
+    NinjaLogReader reader;
+    if (!MapFile(logPath, &log) || !reader.Open(log)) {
+        Fatal("Failed to read %s, or it isn't a ninja log of version 5 or later\n", logPath.CStr());
+    }
+    std::vector<NinjaLogEntry> lastBuild;
+    LastRunFinder lastRun;
+    size_t numRead = 0;
+    size_t numJoined = 0;
+    // Lines are looked up in batches whose slots, and then the keys in them,
+    // are prefetched together, since a log of millions of edges otherwise
+    // spends most of its time waiting on cache misses
+    const int kBatchSize = 16;
+    NinjaLogEntry batch[kBatchSize];
+    uint64_t hashes[kBatchSize];
+    bool more = true;
+    while (more && (!lastRun.ended || numJoined < numWanted)) {
+        int batchSize = 0;
+        while (batchSize < kBatchSize && (more = reader.Previous(&batch[batchSize]))) {
+            hashes[batchSize] = HashBytes(batch[batchSize].output, batch[batchSize].outputLen);
+            edgeIndices.Prefetch(hashes[batchSize]);
+            batchSize++;
+        }
+        for (int i = 0; i < batchSize; i++) {
+            edgeIndices.PrefetchKey(hashes[i]);
+        }
+        numRead += batchSize;
+        for (int i = 0; i < batchSize; i++) {
+            const NinjaLogEntry& entry = batch[i];
+            if (lastRun.Add(entry)) {
+                lastBuild.push_back(entry);
+            }
+            // Only the latest line for each output counts
+            size_t e = edgeIndices.Take(hashes[i], entry.output, entry.outputLen);
+            if (e != HashIndexMap::kAbsent) {
+                edges[e].ms = entry.endMs - std::min(entry.startMs, entry.endMs);
+                numJoined++;
+            }
+        }
+    }
+    double readMs = NowMs() - readStart;
+    ComputeCriticalPaths(&edges);
+
+    printf("bcpp: %s: read %zu entries in %.1f ms, %zu from the last build\n",
+           logPath.CStr(), numRead, readMs, lastBuild.size());
+    if (!lastBuild.empty() && !lastRun.byMtime) {
+        printf("bcpp: warning: %s has no nanosecond mtimes, so if Ninja recompacted it the last build "
+               "may include older runs\n", logPath.CStr());
+    }
+    printf("bcpp: %zu of %zu planned edges have a duration\n", numJoined, numWanted);
+    if (!numJoined) {
+        return 0;
+    }
+
+    size_t last = 0;
+    for (size_t e = 1; e < edges.size(); e++) {
+        if (edges[e].finishMs > edges[last].finishMs) {
+            last = e;
+        }
+    }
+    std::vector<size_t> path;
+    for (size_t e = last; e != HashIndexMap::kAbsent; e = edges[e].critical) {
+        if (edges[e].kind != ReportEdgeKind::Phony) {
+            path.push_back(e);
+        }
+    }
+    printf("\nCritical path: %.2f s over %zu edges\n    start     time  output\n",
+           Seconds(edges[last].finishMs), path.size());
+    for (size_t i = path.size(); i-- > 0;) {
+        const ReportEdge& edge = edges[path[i]];
+        printf("  %7.2f  %7.2f  %s (%s)\n", Seconds(edge.finishMs - edge.ms), Seconds(edge.ms),
+               edge.output.CStr(), project.targets[edge.target].name.CStr());
+    }
+
+    PrintSlowestEdges("Slowest compiles", edges, project.targets,
+                      {ReportEdgeKind::Compile, ReportEdgeKind::Pch}, topN);
+    PrintSlowestEdges("Slowest links", edges, project.targets, {ReportEdgeKind::Link}, topN);
+    PrintTargetTotals(edges, project.targets, topN);
+    PrintParallelism(lastBuild, 20);
+    return 0;
+}
+
+#ifdef BUILDCPP_MAIN
+
+int main(int argc, const char** argv) {
+    if (argc > 1 && strcmp(argv[1], "cache-cxx") == 0) {
+        return CacheCxx(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "run-edge") == 0) {
+        return RunEdge(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "report") == 0) {
+        return Report(argc - 2, argv + 2);
+    }
 
-    fprintf(ninja, "\n");
-    fclose(ninja);
+    // Command line args
+    String changeDir;
+    ConfigureOptions opts;
+    bool daemon = false;
+    bool watch = false;
+    bool verify = false;
+
+    opts.exePath = GetExecutablePath();
+    String& bcppCommandLine = opts.bcppCommandLine;
+    for (int i = 1; i < argc; i++) {
+        if (*argv[i] == '-') {
+            if (IsArg(argv[i], "-C")) {
+                changeDir = ConsumeOneArg(&i, argc, argv);
+            } else if (IsArg(argv[i], "--prefix")) {
+                opts.installPrefix = ConsumeOneArg(&i, argc, argv);
+                bcppCommandLine = FormatString("%s --prefix %s",
+                                        bcppCommandLine.CStr(), opts.installPrefix.CStr());
+            } else if (IsArg(argv[i], "--split")) {
+                opts.splitTargets = true;
+                bcppCommandLine = FormatString("%s --split", bcppCommandLine.CStr());
+            } else if (IsArg(argv[i], "--no-compdb")) {
+                opts.writeCompdb = false;
+                bcppCommandLine = FormatString("%s --no-compdb", bcppCommandLine.CStr());
+            } else if (IsArg(argv[i], "--cache")) {
+                opts.compilerCache = true;
+                bcppCommandLine = FormatString("%s --cache", bcppCommandLine.CStr());
+            } else if (IsArg(argv[i], "--profile-edges")) {
+                opts.profileEdges = true;
+                bcppCommandLine = FormatString("%s --profile-edges", bcppCommandLine.CStr());
+            } else if (IsArg(argv[i], "-g")) {
+                opts.debugBuildLib = true;
+                bcppCommandLine = FormatString("%s -g", bcppCommandLine.CStr());
+            } else if (IsArg(argv[i], "--daemon")) {
+                daemon = true;
+            } else if (IsArg(argv[i], "--watch")) {
+                watch = true;
+            } else if (IsArg(argv[i], "--verify")) {
+                verify = true;
+            } else if (IsArg(argv[i], "-h", "--help")) {
+                Usage();
+            } else {
+                Fatal("Unknown option %s\n", argv[i]);
+            }
+        } else {
+            opts.buildDir = NewString(argv[i]);
+            bcppCommandLine = FormatString("%s %s", bcppCommandLine.CStr(), opts.buildDir.CStr());
+        }
+    }
+
+    if (opts.buildDir.Empty()) {
+        Usage();
+    }
+    if (!changeDir.Empty()) {
+        printf("bcpp: Entering directory '%s'\n", changeDir.CStr()); 
+        ChangeDir(changeDir);
+    }
+    if (!IsFile(String("build.cpp"))) {
+        Fatal("No build.cpp file in current directory\n");
+    }
+    if (!MakeDir(opts.buildDir, true)) {
+        Fatal("Failed to make directory \"%s\"\n", opts.buildDir.CStr());
+    }
 
-    printf("Wrote %s\n", ninjaFile.CStr());
+    if (daemon) {
+        return RunDaemon(opts);
+    }
+    if (watch) {
+        return RunWatch(opts);
+    }
+    if (verify) {
+        return RunVerify(opts);
+    }
+    // A daemon for this build directory has usually regenerated already
+    int daemonStatus = 0;
+    if (RequestFromDaemon(opts, &daemonStatus)) {
+        return daemonStatus;
+    }
+    ConfigureResult result;
+    Configure(opts, &result);
+    return 0;
 }
 
 #endif
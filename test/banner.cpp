@@ -0,0 +1,11 @@
+#include <stdio.h>
+#include <string.h>
+
+void PrintBanner(const char* text) {
+    size_t len = strlen(text);
+    printf("+");
+    for (size_t i = 0; i < len + 2; i++) printf("-");
+    printf("+\n| %s |\n+", text);
+    for (size_t i = 0; i < len + 2; i++) printf("-");
+    printf("+\n");
+}
@@ -1,17 +1,44 @@
+// Small project that uses buildcpp's features, built as a test of them:
+//
+//   buildcpp -C test build && ninja -C test/build && test/build/hello
 
-#define MOBIUS_ENTRY
-#include "mobius/mobius.h"
+#define BUILDCPP_ENTRY
+#include <buildcpp/buildcpp.h>
 
-Project GenProject(Toolchain toolchain) {
+using namespace bcpp;
+
+Project Generate(Toolchain toolchain) {
     toolchain.compiler.standard = Standard::CPP_17;
     toolchain.compiler.buildType = BuildType::Release; 
     toolchain.compiler.rtti = Flag::Off;
     toolchain.compiler.exceptions = Flag::Off;
 
-    Project p(toolchain); 
+    Project project(toolchain); 
+
+    Target version("version", TargetType::SharedLibrary, {"version/version.cpp"});
+    version.publicIncludeDirectories = {"version"};
+    project.targets.emplace_back(std::move(version));
+
+    // Passes version's include directory, and its own generated one, on to
+    // everything depending on words
+    Target words("words", TargetType::StaticLibrary, {"words/shout.cpp"});
+    words.publicIncludeDirectories = {"words", "$builddir/words"};
+    words.generatedHeaders = {
+        GeneratedFile("words/loud.h", "sed 's/^/#define LOUD_/' $in > $out", {"words/loud.txt"}),
+    };
+    words.dependencies = {{"version", Visibility::Public}};
+    // Compiled in heavy_pool
+    words.heavyInputs = {"words/shout.cpp"};
+    project.targets.emplace_back(std::move(words));
 
-    Target hello("hello", TargetType::Executable, {"main.cpp"});
-    p.targets.emplace_back(std::move(hello));
+    // Two unity files, the first including main.cpp and greet.cpp
+    Target hello("hello", TargetType::Executable, {"main.cpp", "greet.cpp", "banner.cpp"});
+    hello.unityBatchSize = 2;
+    hello.precompiledHeader = "pch.h";
+    hello.dependencies = {"words"};
+    // Sizes link_pool
+    hello.linkMemoryMB = 512;
+    project.targets.emplace_back(std::move(hello));
 
-    return p;
+    return project;
 }
@@ -0,0 +1,3 @@
+const char* Greeting() {
+    return "Hello from buildcpp";
+}
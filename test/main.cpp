@@ -1,6 +1,13 @@
-
 #include <stdio.h>
 
+#include "version.h"
+#include "words.h"
+
+const char* Greeting();
+void PrintBanner(const char* text);
+
 int main() {
-    printf("Mobius\n");
+    PrintBanner(Greeting());
+    Shout("version");
+    printf("%s\n", Version());
 }
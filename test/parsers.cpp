@@ -0,0 +1,239 @@
+// Checks for the parsers and file formats buildcpp reads and writes.
+//
+//   c++ -std=c++17 -pthread -Iinclude test/parsers.cpp -o parsers_test
+//   ./parsers_test
+
+#include "../single_include/buildcpp.h"
+
+namespace {
+
+int failures = 0;
+
+void Check(bool ok, const char* expr, int line) {
+    if (!ok) {
+        fprintf(stderr, "test/parsers.cpp:%d: check failed: %s\n", line, expr);
+        failures++;
+    }
+}
+
+#define CHECK(expr) Check((expr), #expr, __LINE__)
+
+bool Equal(const std::vector<String>& got, std::vector<const char*> want) {
+    if (got.size() != want.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < got.size(); i++) {
+        if (strcmp(got[i].CStr(), want[i]) != 0) return false;
+    }
+    return true;
+}
+
+bool DepfileIs(const char* text, std::vector<const char*> want) {
+    auto tempMem = BeginTempStringArena();
+    return Equal(ParseDepfile(tempMem.arena, text, strlen(text)), want);
+}
+
+void TestParseDepfile() {
+    CHECK(DepfileIs("a.o: a.cpp a.h\n", {"a.cpp", "a.h"}));
+    CHECK(DepfileIs("a.o: a.cpp \\\n  a.h \\\n  b.h\n", {"a.cpp", "a.h", "b.h"}));
+    CHECK(DepfileIs("a.o: a.cpp \\\r\n  a.h\r\n", {"a.cpp", "a.h"}));
+    CHECK(DepfileIs("a.o: my\\ dir/a.cpp a.h", {"my dir/a.cpp", "a.h"}));
+    // Only a colon followed by whitespace ends the target
+    CHECK(DepfileIs("C:/out/a.o: a.cpp", {"a.cpp"}));
+    CHECK(DepfileIs("a.o:\n", {}));
+    CHECK(DepfileIs("", {}));
+}
+
+// Object paths are the source path up to ExtPos
+bool StemIs(const char* path, const char* stem) {
+    size_t len = ExtPos(path);
+    return len == strlen(stem) && strncmp(path, stem, len) == 0;
+}
+
+void TestExtPos() {
+    CHECK(StemIs("src/a.cpp", "src/a"));
+    CHECK(StemIs("src/a.pb.cc", "src/a.pb"));
+    CHECK(StemIs("src/v1.2/a.cpp", "src/v1.2/a"));
+    CHECK(StemIs("src/v1.2/Makefile", "src/v1.2/Makefile"));
+    CHECK(StemIs("src/.hidden", "src/.hidden"));
+    CHECK(StemIs("src/..a.cpp", "src/..a"));
+}
+
+void TestPlanUnityBatches() {
+    Target target("t", TargetType::Executable, {"a.cpp", "b.cpp", "c.cpp", "d.cpp", "e.cpp"});
+    target.unityBatchSize = 2;
+    auto batches = PlanUnityBatches(target);
+    CHECK(batches.size() == 3);
+    CHECK(batches.size() == 3 && batches[0] == std::vector<size_t>({0, 1}) &&
+          batches[1] == std::vector<size_t>({2, 3}) && batches[2] == std::vector<size_t>({4}));
+    target.unityBatchSize = 8;
+    CHECK(PlanUnityBatches(target).size() == 1);
+}
+
+bool ExpandsTo(const char* command, const char* expanded) {
+    auto tempMem = BeginTempStringArena();
+    String result = ExpandInOut(tempMem.arena, command, {"a.txt", "b.txt"}, "$builddir/x.h");
+    return strcmp(result.CStr(), expanded) == 0;
+}
+
+void TestExpandInOut() {
+    CHECK(ExpandsTo("gen $in > $out", "gen a.txt b.txt > $builddir/x.h"));
+    CHECK(ExpandsTo("gen ${in} -o ${out}", "gen a.txt b.txt -o $builddir/x.h"));
+    CHECK(ExpandsTo("gen @$in_newline", "gen @a.txt b.txt"));
+    CHECK(ExpandsTo("gen $out.tmp && mv $out.tmp $out",
+                    "gen $builddir/x.h.tmp && mv $builddir/x.h.tmp $builddir/x.h"));
+    // Escapes and other variables are left for Ninja
+    CHECK(ExpandsTo("echo $$in $input $root/$in", "echo $$in $input $root/a.txt b.txt"));
+    CHECK(ExpandsTo("gen $", "gen $"));
+}
+
+bool CompdbStringIs(const char* str, const char* json) {
+    CompdbVars vars{"..", "bcppout", "/src/build"};
+    NinjaWriter w;
+    AppendCompdbString(&w, str, vars);
+    return w.used == strlen(json) && memcmp(w.buf, json, w.used) == 0;
+}
+
+void TestCompdbString() {
+    CHECK(CompdbStringIs("-I$root/include -I$builddir/gen", "-I../include -Ibcppout/gen"));
+    CHECK(CompdbStringIs("-DQ=\"a\\b\" -DT=\t\x1f", "-DQ=\\\"a\\\\b\\\" -DT=\\u0009\\u001f"));
+    CHECK(CompdbStringIs("-DD=$$ -I$$PWD/x $rootx", "-DD=$ -I/src/build/x $rootx"));
+}
+
+void TestReadManifest() {
+    char dir[] = "/tmp/bcpp_parsers.XXXXXX";
+    if (!mkdtemp(dir)) {
+        Fatal("Failed to make a temporary directory\n");
+    }
+    auto tempMem = BeginTempStringArena();
+    String input = FormatString(tempMem.arena, "%s/a.h", dir);
+    WriteFile(input, "int a;\n", 7);
+    CacheKey inputKey;
+    AddFile(&inputKey, input.CStr());
+    auto inputLine = [&]() {
+        return FormatString(tempMem.arena, "%016llx%016llx %s\n", static_cast<unsigned long long>(inputKey.h[0]),
+                            static_cast<unsigned long long>(inputKey.h[1]), input.CStr());
+    };
+    // Two entries, then one cut short by a crash while writing
+    String manifest = FormatString(tempMem.arena,
+        "00000000000000010000000000000002 1\n%s"
+        "00000000000000030000000000000004 2\n%s%s"
+        "00000000000000050000000000000006 2\n%s",
+        inputLine().CStr(), inputLine().CStr(), inputLine().CStr(), inputLine().CStr());
+    String path = FormatString(tempMem.arena, "%s/x.manifest", dir);
+    WriteFile(path, manifest.CStr(), manifest.Len());
+
+    auto entries = ReadManifest(tempMem.arena, path);
+    CHECK(entries.size() == 2);
+    if (entries.size() == 2) {
+        CHECK(entries[0].result.h[0] == 1 && entries[0].result.h[1] == 2);
+        CHECK(entries[1].result.h[0] == 3 && entries[1].result.h[1] == 4);
+        CHECK(ManifestEntryMatches(entries[0]));
+        WriteFile(input, "int b;\n", 7);
+        CHECK(!ManifestEntryMatches(entries[0]));
+    }
+    CHECK(ReadManifest(tempMem.arena, FormatString(tempMem.arena, "%s/missing", dir)).empty());
+    Run(FormatString(tempMem.arena, "rm -rf %s", dir));
+}
+
+std::vector<InternedString> Flags(std::vector<const char*> flags) {
+    std::vector<InternedString> interned;
+    for (const char* flag : flags) {
+        interned.push_back(InternString(flag));
+    }
+    return interned;
+}
+
+void TestDeduplicateFlags() {
+    const std::vector<const char*> cases[] = {
+        // Search paths keep their first occurrence, other flags their last
+        {"-Ia", "-Ib", "-Ia", "-DX", "-Wall", "-DX", "-Ib"},
+        {"-DFOO", "-UFOO", "-DFOO"},
+        // Separate values are never dropped, nor taken for flags
+        {"-include", "a.h", "-include", "a.h", "-I", "b", "-I", "b"},
+        {"-Xclang", "-Ia", "-Ia", "-Xclang", "-Ia", "-Ia"},
+        {"-D", "-DX", "-DX", "-D", "-DX"},
+    };
+    for (const auto& flags : cases) {
+        std::vector<InternedString> appended;
+        for (InternedString flag : Flags(flags)) {
+            AppendCompileFlag(appended, flag);
+        }
+        std::vector<InternedString> deduplicated = Flags(flags);
+        DeduplicateFlags(deduplicated);
+        CHECK(deduplicated == appended);
+    }
+    std::vector<InternedString> flags = Flags(cases[0]);
+    DeduplicateFlags(flags);
+    CHECK(flags == Flags({"-Ia", "-Ib", "-Wall", "-DX"}));
+}
+
+// The outputs of a log's last run, read newest first, and whether it was
+// told apart by mtime
+std::vector<String> LastRun(const char* text, bool* byMtime) {
+    MappedFile log;
+    log.data = text;
+    log.len = strlen(text);
+    NinjaLogReader reader;
+    std::vector<String> outputs;
+    if (!reader.Open(log)) {
+        return outputs;
+    }
+    LastRunFinder lastRun;
+    NinjaLogEntry entry;
+    while (reader.Previous(&entry)) {
+        if (lastRun.Add(entry)) {
+            outputs.push_back(NewString(entry.output, int(entry.outputLen)));
+        }
+    }
+    *byMtime = lastRun.byMtime;
+    return outputs;
+}
+
+void TestNinjaLog() {
+    bool byMtime = false;
+    CHECK(LastRun("# ninja log v4\n0\t10\t0\ta.o\t1\n", &byMtime).empty());
+    // Two runs a minute apart, with a line cut short by a crash
+    CHECK(Equal(LastRun("# ninja log v5\n"
+                        "0\t100\t1700000000100000000\ta.o\t1\n"
+                        "0\t300\t1700000000300000000\tb.o\t2\n"
+                        "0\t200\t1700000060200000000\ta.o\t1\n"
+                        "0\t250\t1700000060250000000\tc.o\t3\n"
+                        "0\t400\t17000000", &byMtime),
+                {"c.o", "a.o"}));
+    CHECK(byMtime);
+    // Recompacted: the older lines ending earlier than the last run's first
+    // edge don't make end times go up
+    CHECK(Equal(LastRun("# ninja log v5\n"
+                        "0\t300\t1700000000300000000\tb.o\t2\n"
+                        "0\t50\t1700000000050000000\td.o\t4\n"
+                        "0\t200\t1700000060200000000\ta.o\t1\n"
+                        "0\t250\t1700000060250000000\tc.o\t3\n", &byMtime),
+                {"c.o", "a.o"}));
+    // Seconds mtimes from before Ninja 1.9 leave only end times
+    CHECK(Equal(LastRun("# ninja log v5\n"
+                        "0\t300\t1700000000\tb.o\t2\n"
+                        "0\t200\t1700000060\ta.o\t1\n"
+                        "0\t250\t1700000060\tc.o\t3\n", &byMtime),
+                {"c.o", "a.o"}));
+    CHECK(!byMtime);
+}
+
+} // namespace
+
+int main() {
+    TestParseDepfile();
+    TestExtPos();
+    TestPlanUnityBatches();
+    TestExpandInOut();
+    TestCompdbString();
+    TestReadManifest();
+    TestDeduplicateFlags();
+    TestNinjaLog();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,3 @@
+// Force included ahead of every source of hello
+#include <stdio.h>
+#include <string.h>
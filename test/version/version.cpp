@@ -0,0 +1,5 @@
+#include "version.h"
+
+const char* Version() {
+    return "1.0";
+}
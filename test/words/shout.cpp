@@ -0,0 +1,13 @@
+#include "words.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include "loud.h"
+
+void Shout(const char* text) {
+    for (const char* c = text; *c; c++) {
+        putchar(toupper(*c));
+    }
+    printf("%s\n", LOUD_MARK);
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// Prints text in upper case
+void Shout(const char* text);